@@ -0,0 +1,17 @@
+#pragma once
+// a monotonic time source for the sampler's transport
+class clock_source {
+public:
+    // microseconds since some fixed point. never goes backwards
+    virtual unsigned long long now()=0;
+};
+// a clock that only moves when told to, for running
+// the sampler off the hardware or faster than real time
+class virtual_clock final : public clock_source {
+    unsigned long long m_now;
+public:
+    inline virtual_clock(unsigned long long start = 0) : m_now(start) {}
+    virtual unsigned long long now() { return m_now; }
+    inline void advance(unsigned long long microseconds) { m_now+=microseconds; }
+    inline void set(unsigned long long value) { if(value>m_now) { m_now = value; } }
+};
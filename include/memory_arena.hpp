@@ -0,0 +1,35 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+// hands out memory from one fixed block and takes it all back
+// at once with reset(). the block can live anywhere, such as
+// DTCM, OCRAM (DMAMEM) or PSRAM (EXTMEM)
+class memory_arena final {
+    uint8_t* m_begin;
+    size_t m_capacity;
+    size_t m_used;
+    size_t m_peak;
+    // the offset of the most recent allocation,
+    // which is the only one that can be given back early
+    size_t m_last;
+    memory_arena(const memory_arena& rhs)=delete;
+    memory_arena& operator=(const memory_arena& rhs)=delete;
+public:
+    memory_arena(void* buffer,size_t capacity);
+    void* allocate(size_t size);
+    void deallocate(void* ptr);
+    // frees everything at once
+    void reset();
+    inline size_t capacity() const { return m_capacity; }
+    inline size_t used() const { return m_used; }
+    // the most ever in use at once
+    inline size_t peak() const { return m_peak; }
+};
+// adapts an arena to the allocator and deallocator arguments
+// that midi_sampler and midi_quantizer take
+template<memory_arena& Arena> void* arena_allocate(size_t size) {
+    return Arena.allocate(size);
+}
+template<memory_arena& Arena> void arena_deallocate(void* ptr) {
+    Arena.deallocate(ptr);
+}
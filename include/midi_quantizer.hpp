@@ -28,7 +28,8 @@ public:
     inline unsigned long long last_key_ticks() const { return m_last_key_ticks;}
     inline midi_quantizer_timing last_timing() const { return m_last_timing;}
     void quantize_beats(int value);
-    sfx::sfx_result start(size_t index);
+    // ago is how many microseconds before now the key was pressed
+    sfx::sfx_result start(size_t index,unsigned long long ago = 0);
     sfx::sfx_result stop(size_t index);
     static sfx::sfx_result create(midi_sampler& sampler,midi_quantizer* out_quantizer, void*(*allocator)(size_t)=::malloc,void(*deallocator)(void*)=::free);
 };
\ No newline at end of file
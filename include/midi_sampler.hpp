@@ -1,27 +1,256 @@
 #pragma once
 #include <string.h>
 #include <sfx_midi_core.hpp>
-#include <sfx_midi_clock.hpp>
 #include "note_tracker.hpp"
+#include "clock_source.hpp"
+// a midi_output that can hold messages until they're due
+class midi_timed_output : public sfx::midi_output {
+public:
+    // sends message at due, in clock_source microseconds. tag
+    // identifies the sender, so its messages can be cancelled
+    virtual sfx::sfx_result send_at(const sfx::midi_message& message,unsigned long long due,size_t tag)=0;
+    // drops the messages with tag that haven't gone out yet,
+    // except note offs, which should go out right away
+    virtual void cancel(size_t tag)=0;
+};
 class midi_sampler final {
+    // a position in the raw track
+    struct cursor {
+        size_t offset;
+        uint32_t tick;
+        uint8_t status;
+    };
+    // events are pre-decoded into windows of parallel arrays:
+    // ticks holds the absolute tick of each event
+    // events holds the status in the low byte, followed by
+    // the data bytes, or for tempo changes the microtempo,
+    // or for sysex the index into the window's sysex table
+    // sysex payloads are kept in the window too, so playing
+    // a track never allocates. this is where one lives
+    struct sysex_span {
+        uint32_t offset;
+        uint32_t size;
+        uint8_t status;
+    };
+    struct window {
+        uint32_t* ticks;
+        uint32_t* events;
+        sysex_span* sysex;
+        // the bytes the sysex table points into
+        uint8_t* sysex_data;
+        size_t size;
+        size_t sysex_size;
+        size_t sysex_data_size;
+        // the track relative byte offset the window starts at,
+        // or npos if the window is empty, and where it leaves off
+        size_t begin;
+        cursor end;
+        // true if this is the last window in the track
+        bool final;
+    };
+    // the state needed to start playing partway into a track
+    struct checkpoint {
+        // the tick of the first event not yet applied
+        uint32_t tick;
+        // in memory, the index of that event. when
+        // streaming, the cursor to start decoding from
+        uint32_t position;
+        cursor at;
+        // the controllers and patches to chase, which is a range
+        // of track::chase, and the number of sysex messages before
+        uint32_t chase_begin;
+        uint32_t chase_size;
+        uint32_t sysex_count;
+    };
+    // a run of the song at one tempo. time is the
+    // microseconds from the start of the song to tick
+    struct tempo_segment {
+        uint32_t tick;
+        int32_t microtempo;
+        unsigned long long time;
+    };
     struct track {
-        sfx::midi_clock clock;
-        sfx::midi_event_ex event;
         note_tracker tracker;
-        int32_t base_microtempo;
-        float tempo_multiplier;
-        unsigned long long delay;
-        uint8_t* buffer;
-        size_t buffer_size;
-        size_t buffer_position;
-        sfx::midi_output* output;
+        // the whole track, or when streaming, the start of it
+        window head;
+        // the refillable windows used when streaming
+        window ring[2];
+        window* current;
+        size_t position;
+        uint32_t length;
+        // where the track lives in the stream
+        size_t offset;
+        size_t size;
+        checkpoint* checkpoints;
+        size_t checkpoints_size;
+        uint32_t* chase;
+        // every sysex message in the track, in order, to chase. in
+        // memory that's the head window's table. when streaming it's
+        // a copy in the seek index, so chasing doesn't read the stream
+        sysex_span* chase_sysex;
+        uint8_t* chase_sysex_data;
+        // transport time (in microseconds) the track reaches
+        // the anchor, and the anchor's time on the tempo map.
+        // moves forward on every loop
+        unsigned long long anchor_time;
+        unsigned long long anchor_offset;
+        // true once the track has looped since start()
+        bool looped;
+        // transport time start() was called
+        unsigned long long start_time;
+        // transport time the next event is due
+        unsigned long long due;
+        // position in the schedule heap, or npos if stopped
+        size_t heap_index;
+    };
+    // stamps everything a track sends with when it's due
+    struct timed_sink final : public sfx::midi_output {
+        midi_timed_output* output;
+        unsigned long long due;
+        size_t tag;
+        virtual sfx::sfx_result send(const sfx::midi_message& message) {
+            return output->send_at(message,due,tag);
+        }
+    };
+    // where update_to(), start_to() and stop_to() send things.
+    // output_sink follows output(), going through the virtual
+    // midi_output, while static_sink has the sink's type at
+    // compile time so its send() can be inlined
+    struct output_sink {
+        midi_sampler* sampler;
+        inline sfx::midi_output* operator()(track& t,unsigned long long time) const { return sampler->sink(t,time); }
+        inline unsigned long long lookahead() const { return sampler->m_timed!=nullptr?sampler->m_lookahead:0; }
+        inline void cancel(size_t index) const {
+            if(sampler->m_timed!=nullptr) {
+                sampler->m_timed->cancel(index);
+            }
+        }
+    };
+    template<typename Sink>
+    struct static_sink {
+        Sink* sink;
+        inline Sink* operator()(track& t,unsigned long long time) const { return sink; }
+        inline unsigned long long lookahead() const { return 0; }
+        inline void cancel(size_t index) const {}
     };
+    constexpr static const size_t npos = (size_t)-1;
+    constexpr static const size_t sysex_window_size = 4;
+    // the sysex bytes each window can hold when streaming. a
+    // track with a longer sysex message can't be opened
+    constexpr static const size_t sysex_data_window_size = 512;
+    constexpr static const size_t scratch_size = 512;
+    // how far apart checkpoints are, in beats
+    constexpr static const size_t checkpoint_beats = 16;
+    // one entry per controller and patch on every channel
+    constexpr static const size_t chase_work_size = 16*129;
     void* (*m_allocator)(size_t);
     void (*m_deallocator)(void*);
     size_t m_tracks_size;
     track* m_tracks;
+    int16_t m_timebase;
+    // the one block holding every track's windows
+    void* m_storage;
+    // the one block holding every track's seek index
+    void* m_index;
+    // the tempo changes from every track, sorted by tick
+    tempo_segment* m_tempo_map;
+    size_t m_tempo_map_size;
+    sfx::midi_output* m_output;
+    // when m_output is timed, events are sent up to
+    // m_lookahead microseconds early, through m_sink
+    midi_timed_output* m_timed;
+    unsigned long long m_lookahead;
+    // the transport time update() plays up to
+    unsigned long long m_horizon;
+    timed_sink m_sink;
+    // where the transport gets its time, or null for std::chrono
+    clock_source* m_clock;
+    // the master transport. m_now is scaled by the
+    // tempo multiplier, which is in 16.16 fixed point
+    unsigned long long m_now;
+    unsigned long long m_clock_last;
+    uint32_t m_clock_fraction;
+    uint32_t m_tempo_multiplier;
+    // min-heap of playing tracks keyed on track::due
+    size_t* m_heap;
+    size_t m_heap_size;
+    // a bit for each track, set while it's started
+    uint32_t* m_active;
+    // how many tracks hold each note, so shared notes
+    // are only started and stopped once
+    voice_table* m_voices;
+    // streaming state. m_stream is null when
+    // the tracks are entirely in memory
+    sfx::stream* m_stream;
+    uint8_t* m_scratch;
+    size_t m_window_size;
+    unsigned long long m_underruns;
+    bool m_all_notes_off;
 
-    static void callback(uint32_t pending,unsigned long long elapsed, void* state);
+    unsigned long long clock_now() const;
+    void advance_transport();
+    unsigned long long transport_now() const;
+    unsigned long long elapsed_at(const track& t,unsigned long long time) const;
+    unsigned long long tick_time(uint32_t tick) const;
+    uint32_t time_tick(unsigned long long time) const;
+    unsigned long long time_of(const track& t,uint32_t tick) const;
+    unsigned long long next_due(const track& t) const;
+    unsigned long long clock_time(unsigned long long time) const;
+    sfx::midi_output* sink(track& t,unsigned long long time);
+    template<typename Sinks>
+    void send_event(const Sinks& sinks,track& t,uint32_t event,unsigned long long time);
+    template<typename Sinks>
+    bool play(const Sinks& sinks,track& t);
+    window* successor(track& t,const window& w);
+    sfx::sfx_result fill(track& t,window& w,const cursor& from);
+    sfx::sfx_result index_track(track& t,uint32_t* work,size_t* out_checkpoints_size,size_t* out_chase_size,size_t* out_sysex_size,size_t* out_sysex_data_size,size_t* out_tempo_size);
+    void build_tempo_map();
+    const checkpoint* find_checkpoint(const track& t,uint32_t tick) const;
+    template<typename Sinks>
+    sfx::sfx_result seek(const Sinks& sinks,track& t,uint32_t tick);
+    sfx::sfx_result next_window(track& t);
+    template<typename Sinks>
+    sfx::sfx_result trigger(const Sinks& sinks,track& t);
+    template<typename Sinks>
+    sfx::sfx_result update_to(const Sinks& sinks);
+    template<typename Sinks>
+    sfx::sfx_result start_to(const Sinks& sinks,size_t index,long long advance);
+    template<typename Sinks>
+    sfx::sfx_result stop_to(const Sinks& sinks,size_t index);
+    void refill();
+    void heap_swap(size_t lhs,size_t rhs);
+    void heap_up(size_t index);
+    void heap_down(size_t index);
+    void heap_push(size_t track_index);
+    void heap_remove(size_t heap_index);
+    // true if the event is chased when starting partway in
+    inline static bool is_chased(uint32_t event) {
+        switch(uint8_t(event)&0xF0) {
+            case 0xB0: // control change
+            case 0xC0: // program change
+            case 0xF0: // tempo or sysex
+                return true;
+            default:
+                return false;
+        }
+    }
+    static void init_track(track& t);
+    static void decode_window(sfx::stream& in,size_t size,cursor& cur,window& w,size_t capacity,size_t sysex_capacity,size_t sysex_data_capacity);
+    // sends a sysex from where data holds it without copying it. the
+    // message only borrows the bytes, so it lets go before it's destroyed
+    template<typename Output>
+    static void send_sysex(Output& output,const sysex_span& span,uint8_t* data) {
+        sfx::midi_message msg;
+        msg.status = span.status;
+        msg.sysex.data = data+span.offset;
+        msg.sysex.size = span.size;
+        output.send(msg);
+        msg.sysex.data = nullptr;
+    }
+    static void count_track(const uint8_t* buffer,size_t size,track& t);
+    static uint8_t* decode_track(const uint8_t* buffer,size_t size,track& t,uint8_t* storage);
+    static void free_track(track& t);
+    static sfx::sfx_result load(sfx::stream& stream,midi_sampler* out_sampler,size_t window_size,void*(allocator)(size_t),void(deallocator)(void*),void*(image_allocator)(size_t),void(image_deallocator)(void*));
     void deallocate();
     midi_sampler(const midi_sampler& rhs)=delete;
     midi_sampler& operator=(const midi_sampler& rhs)=delete;
@@ -32,12 +261,286 @@ public:
     ~midi_sampler();
     sfx::sfx_result update();
     void output(sfx::midi_output* value);
+    // plays into value up to lookahead microseconds ahead of time,
+    // leaving it to send each event when it's due
+    void output(midi_timed_output* value,unsigned long long lookahead);
+    // sets the time source for the transport. null uses std::chrono's steady clock
+    void clock(clock_source* value);
     int16_t timebase(size_t index) const;
     unsigned long long elapsed(size_t index) const;
+    // the ticks elapsed as of ago microseconds of real time
+    // before now, such as when an input message arrived
+    unsigned long long elapsed(size_t index,unsigned long long ago) const;
     inline size_t tracks_count() const { return m_tracks_size; }
+    inline bool streaming() const { return m_stream!=nullptr; }
+    // the number of times a streaming track ran dry
+    // before its next window was refilled
+    inline unsigned long long underruns() const { return m_underruns; }
+    // when true, stopping or looping a track sends all notes off
+    // on each channel it holds notes on, rather than each note off
+    inline bool all_notes_off() const { return m_all_notes_off; }
+    inline void all_notes_off(bool value) { m_all_notes_off = value; }
     sfx::sfx_result start(size_t index,long long advance = 0);
     bool started(size_t index) const;
+    // the first started track at or after index,
+    // or tracks_count() if there isn't one
+    size_t next_started(size_t index) const;
     sfx::sfx_result stop(size_t index);
+    // update(), start() and stop(), but into sink instead of output().
+    // the sink's type is known at compile time, so if it's final or
+    // not virtual its send() can be inlined. there's no lookahead
+    template<typename Sink>
+    inline sfx::sfx_result update(Sink& sink) { return update_to(static_sink<Sink> {&sink}); }
+    template<typename Sink>
+    inline sfx::sfx_result start(size_t index,long long advance,Sink& sink) { return start_to(static_sink<Sink> {&sink},index,advance); }
+    template<typename Sink>
+    inline sfx::sfx_result stop(size_t index,Sink& sink) { return stop_to(static_sink<Sink> {&sink},index); }
     void tempo_multiplier(float value);
-    static sfx::sfx_result read(sfx::stream& stream,midi_sampler* out_sampler,void*(allocator)(size_t)=::malloc,void(deallocator)(void*)=::free);
-};
\ No newline at end of file
+    // reads every track entirely into memory. the file is read in one go
+    // into a temporary block from image_allocator, or allocator if null,
+    // such as external RAM
+    static sfx::sfx_result read(sfx::stream& stream,midi_sampler* out_sampler,void*(allocator)(size_t)=::malloc,void(deallocator)(void*)=::free,void*(image_allocator)(size_t)=nullptr,void(image_deallocator)(void*)=nullptr);
+    // streams the tracks from the stream, keeping window_size events
+    // per window in memory. the stream must stay open while the sampler
+    // is in use. fails with not_supported if a sysex message is longer
+    // than sysex_data_window_size, which read() can still play
+    static sfx::sfx_result open(sfx::stream& stream,midi_sampler* out_sampler,size_t window_size=64,void*(allocator)(size_t)=::malloc,void(deallocator)(void*)=::free);
+};
+template<typename Sinks>
+void midi_sampler::send_event(const Sinks& sinks,track& t,uint32_t event,unsigned long long time) {
+    uint8_t status = uint8_t(event);
+    if(status==0xFF) {
+        // tempo changes are already in the tempo map
+        return;
+    }
+    auto output = sinks(t,time);
+    if(status==0xF0 || status==0xF7) {
+        if(output!=nullptr) {
+            send_sysex(*output,t.current->sysex[event>>8],t.current->sysex_data);
+        }
+    } else {
+        sfx::midi_message msg;
+        msg.status = status;
+        msg.msb(uint8_t(event>>8));
+        msg.lsb(uint8_t(event>>16));
+        // notes other tracks are already sounding, or
+        // still need, are left alone
+        if(t.tracker.process(msg,m_voices) && output!=nullptr) {
+            output->send(msg);
+        }
+    }
+}
+template<typename Sinks>
+bool midi_sampler::play(const Sinks& sinks,track& t) {
+    bool looped = false;
+    while(true) {
+        window& w = *t.current;
+        if(t.position>=w.size) {
+            if(!w.final) {
+                window* next = successor(t,w);
+                if(next==nullptr) {
+                    // the refill hasn't caught up yet,
+                    // so try again on the next update
+                    ++m_underruns;
+                    t.due = m_horizon+1;
+                    return true;
+                }
+                t.current = next;
+                t.position = 0;
+                continue;
+            }
+            if(t.length==0) {
+                // nothing to loop
+                return false;
+            }
+            unsigned long long loop_time = time_of(t,t.length);
+            if(looped || loop_time>m_horizon) {
+                t.due = loop_time;
+                return true;
+            }
+            // end of track, so loop
+            t.current = &t.head;
+            t.position = 0;
+            t.anchor_time = loop_time;
+            t.anchor_offset = 0;
+            t.looped = true;
+            auto output = sinks(t,loop_time);
+            if(output!=nullptr) {
+                t.tracker.send_off(*output,m_all_notes_off,m_voices);
+            } else {
+                t.tracker.reset(m_voices);
+            }
+            looped = true;
+            continue;
+        }
+        unsigned long long time = time_of(t,w.ticks[t.position]);
+        if(time>m_horizon) {
+            t.due = time;
+            return true;
+        }
+        send_event(sinks,t,w.events[t.position],time);
+        ++t.position;
+    }
+}
+template<typename Sinks>
+sfx::sfx_result midi_sampler::seek(const Sinks& sinks,track& t,uint32_t tick) {
+    // restore the state at the closest checkpoint
+    const checkpoint* cp = find_checkpoint(t,tick);
+    t.current = &t.head;
+    t.position = 0;
+    if(cp!=nullptr) {
+        auto output = sinks(t,m_now);
+        if(output!=nullptr) {
+            for(uint32_t i = 0;i<cp->sysex_count;++i) {
+                send_sysex(*output,t.chase_sysex[i],t.chase_sysex_data);
+            }
+        }
+        for(uint32_t i = 0;i<cp->chase_size;++i) {
+            send_event(sinks,t,t.chase[cp->chase_begin+i],m_now);
+        }
+        if(m_stream==nullptr) {
+            t.position = cp->position;
+        } else if(cp->at.offset!=0) {
+            window& w = t.ring[0];
+            if(w.begin!=cp->at.offset) {
+                sfx::sfx_result res = fill(t,w,cp->at);
+                if(res!=sfx::sfx_result::success) {
+                    return res;
+                }
+            }
+            t.current = &w;
+        }
+    }
+    // then chase the few events between it and tick
+    while(true) {
+        window& w = *t.current;
+        if(t.position>=w.size) {
+            if(w.final) {
+                break;
+            }
+            sfx::sfx_result res = next_window(t);
+            if(res!=sfx::sfx_result::success) {
+                return res;
+            }
+            continue;
+        }
+        if(w.ticks[t.position]>=tick) {
+            break;
+        }
+        uint32_t e = w.events[t.position];
+        if(is_chased(e)) {
+            send_event(sinks,t,e,m_now);
+        }
+        ++t.position;
+    }
+    return sfx::sfx_result::success;
+}
+template<typename Sinks>
+sfx::sfx_result midi_sampler::trigger(const Sinks& sinks,track& t) {
+    // send the events at the start point from the calling
+    // thread, rather than leaving them for the next update()
+    while(true) {
+        window& w = *t.current;
+        if(t.position>=w.size) {
+            if(w.final) {
+                break;
+            }
+            sfx::sfx_result res = next_window(t);
+            if(res!=sfx::sfx_result::success) {
+                return res;
+            }
+            continue;
+        }
+        if(time_of(t,w.ticks[t.position])>m_now) {
+            break;
+        }
+        send_event(sinks,t,w.events[t.position],m_now);
+        ++t.position;
+    }
+    return sfx::sfx_result::success;
+}
+template<typename Sinks>
+sfx::sfx_result midi_sampler::update_to(const Sinks& sinks) {
+    advance_transport();
+    // with a timed output, render a little ahead and let it
+    // release the events on time
+    m_horizon = m_now+((sinks.lookahead()*m_tempo_multiplier)>>16);
+    // only the tracks that are due get touched
+    while(m_heap_size>0 && m_tracks[m_heap[0]].due<=m_horizon) {
+        if(play(sinks,m_tracks[m_heap[0]])) {
+            heap_down(0);
+        } else {
+            heap_remove(0);
+        }
+    }
+    if(m_stream!=nullptr) {
+        // I/O happens after the events are out
+        refill();
+    }
+    return sfx::sfx_result::success;
+}
+template<typename Sinks>
+sfx::sfx_result midi_sampler::start_to(const Sinks& sinks,size_t index,long long advance) {
+    if(0>index || index>=m_tracks_size) {
+        return sfx::sfx_result::invalid_argument;
+    }
+    track& t = m_tracks[index];
+    if(started(index)) {
+        stop_to(sinks,index);
+    }
+    // a track with nothing to loop leaves the heap at its end
+    // without being stopped, so it's rewound here either way
+    t.current = &t.head;
+    t.position = 0;
+    // anchor to the current time, not the last update()
+    advance_transport();
+    t.looped = false;
+    t.start_time = m_now;
+    t.anchor_time = m_now;
+    t.anchor_offset = 0;
+    if(advance>0) {
+        if(t.length!=0) {
+            advance %= t.length;
+        }
+        // chase the tempo, patches, controllers and sysex
+        // up to the advance point
+        sfx::sfx_result res = seek(sinks,t,(uint32_t)advance);
+        if(res!=sfx::sfx_result::success) {
+            return res;
+        }
+        t.anchor_time = m_now;
+        t.anchor_offset = tick_time((uint32_t)advance);
+    } else if(advance<0) {
+        // hold off until the delay has elapsed, timed
+        // as though it were the start of the song
+        t.anchor_time = m_now+tick_time((uint32_t)-advance);
+    }
+    sfx::sfx_result res = trigger(sinks,t);
+    if(res!=sfx::sfx_result::success) {
+        return res;
+    }
+    t.due = next_due(t);
+    heap_push(index);
+    return sfx::sfx_result::success;
+}
+template<typename Sinks>
+sfx::sfx_result midi_sampler::stop_to(const Sinks& sinks,size_t index) {
+    if(0>index || index>=m_tracks_size) {
+        return sfx::sfx_result::invalid_argument;
+    }
+    track& t = m_tracks[index];
+    if(t.heap_index!=npos) {
+        heap_remove(t.heap_index);
+    }
+    t.current = &t.head;
+    t.position = 0;
+    // don't play what was rendered ahead
+    sinks.cancel(index);
+    auto output = sinks(t,m_now);
+    if(output!=nullptr) {
+        t.tracker.send_off(*output,m_all_notes_off,m_voices);
+    } else {
+        t.tracker.reset(m_voices);
+    }
+    return sfx::sfx_result::success;
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <sfx_midi_core.hpp>
+// the queue behind midi_scheduler_teensy, without the timer or the
+// output, so it can be driven and tested anywhere. push() and cancel()
+// are called by the sender and promote() by the timer, and those must
+// not run at the same time. drain() may run alongside promote(), since
+// the two only share the ready ring, which has one writer and one reader
+class midi_schedule final {
+public:
+    constexpr static const size_t capacity = 256;
+    // a power of two
+    constexpr static const size_t ready_capacity = 256;
+    constexpr static const size_t sysex_capacity = 8;
+    // the longest sysex a slot holds, the same as the
+    // longest a streaming sampler can play
+    constexpr static const size_t sysex_length = 512;
+private:
+    // message is packed like the sampler's events, or for
+    // sysex the status followed by the slot in m_sysex_data
+    struct entry {
+        unsigned long long due;
+        uint32_t sequence;
+        uint32_t message;
+        size_t tag;
+    };
+    constexpr static const size_t npos = (size_t)-1;
+    enum struct slot_state : uint8_t {
+        empty = 0,
+        queued,
+        sent
+    };
+    // min-heap on due, then sequence so equal times keep their order
+    entry m_heap[capacity];
+    size_t m_size;
+    uint32_t m_sequence;
+    // due messages waiting for drain(). promote() only moves the
+    // tail and drain() only moves the head
+    uint32_t m_ready[ready_capacity];
+    volatile size_t m_ready_head;
+    volatile size_t m_ready_tail;
+    // sysex is copied in rather than held by a midi_message
+    // so queueing it doesn't allocate
+    uint8_t m_sysex_data[sysex_capacity][sysex_length];
+    size_t m_sysex_size[sysex_capacity];
+    volatile slot_state m_sysex_state[sysex_capacity];
+    // how late promote() found events, in microseconds
+    uint32_t m_released;
+    unsigned long long m_total_lateness;
+    uint32_t m_max_lateness;
+    bool less(size_t lhs,size_t rhs) const;
+    void heap_down(size_t index);
+    void heap_up(size_t index);
+    entry pop();
+    bool ready_put(uint32_t message);
+    midi_schedule(const midi_schedule& rhs)=delete;
+    midi_schedule& operator=(const midi_schedule& rhs)=delete;
+public:
+    midi_schedule();
+    // queues message to be ready at due, in clock_source microseconds.
+    // returns out_of_memory when the queue is full, except for note
+    // offs, which make room by readying the earliest message early,
+    // or when a sysex is longer than sysex_length or has no free slot
+    sfx::sfx_result push(const sfx::midi_message& message,unsigned long long due,size_t tag);
+    // drops the messages with tag that aren't ready yet, except
+    // note offs, which are made due right away
+    void cancel(size_t tag);
+    // moves everything due by now into the ready ring, in order,
+    // returning true if there's anything for drain() to send
+    bool promote(unsigned long long now);
+    // sends what's ready through output, which needs send() for sysex
+    // and send_packed() for the rest. returns true if it sent anything
+    template<typename Output>
+    bool drain(Output& output) {
+        size_t head = m_ready_head;
+        if(head==m_ready_tail) {
+            return false;
+        }
+        do {
+            std::atomic_signal_fence(std::memory_order_acquire);
+            uint32_t message = m_ready[head];
+            uint8_t status = uint8_t(message);
+            if(status==0xF0 || status==0xF7) {
+                // the message only borrows the slot's
+                // bytes, so it lets go before it's destroyed
+                size_t slot = message>>8;
+                sfx::midi_message msg;
+                msg.status = status;
+                msg.sysex.data = m_sysex_data[slot];
+                msg.sysex.size = m_sysex_size[slot];
+                output.send(msg);
+                msg.sysex.data = nullptr;
+                m_sysex_state[slot] = slot_state::sent;
+            } else {
+                output.send_packed(message);
+            }
+            head = (head+1)&(ready_capacity-1);
+            std::atomic_signal_fence(std::memory_order_release);
+            m_ready_head = head;
+        } while(head!=m_ready_tail);
+        return true;
+    }
+    // drops everything, ready or not. nothing may be running alongside
+    void clear();
+    // the number of messages not yet ready
+    inline size_t size() const { return m_size; }
+    inline bool ready() const { return m_ready_head!=m_ready_tail; }
+    // the number of events promoted, and how late they were
+    inline uint32_t released() const { return m_released; }
+    inline uint32_t max_lateness() const { return m_max_lateness; }
+    inline unsigned long long total_lateness() const { return m_total_lateness; }
+    void reset_lateness();
+};
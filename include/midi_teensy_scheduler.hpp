@@ -0,0 +1,45 @@
+#pragma once
+#include <Arduino.h>
+#include <sfx.hpp>
+#include "midi_sampler.hpp"
+#include "midi_schedule.hpp"
+#include "midi_teensy_usb.hpp"
+// holds timed messages for a midi_out_teensy_usb. a timer interrupt
+// moves each one to the ready ring once it's due, and a software
+// interrupt at the lowest priority sends them, so the USB is never
+// written with interrupts masked or from the timer. while it's running,
+// everything for that output must go through the scheduler, since the
+// software interrupt owns it
+class midi_scheduler_teensy final : public midi_timed_output {
+    midi_out_teensy_usb* m_output;
+    clock_source* m_clock;
+    IntervalTimer m_timer;
+    bool m_running;
+    midi_schedule m_schedule;
+    static midi_scheduler_teensy* s_instance;
+    static void release_s();
+    static void send_s();
+    midi_scheduler_teensy(const midi_scheduler_teensy& rhs)=delete;
+    midi_scheduler_teensy& operator=(const midi_scheduler_teensy& rhs)=delete;
+public:
+    midi_scheduler_teensy();
+    ~midi_scheduler_teensy();
+    // starts releasing into output every period microseconds,
+    // which bounds the timing jitter. only one can run at a time.
+    // takes over IRQ_SOFTWARE for sending
+    sfx::sfx_result begin(midi_out_teensy_usb& output,clock_source& clock,uint32_t period = 100);
+    // sends everything still queued, and stops the timer
+    void end();
+    inline bool running() const { return m_running; }
+    // queues the message to go out right away
+    virtual sfx::sfx_result send(const sfx::midi_message& message);
+    // returns out_of_memory when the queue is full, except for note
+    // offs, which make room by sending the earliest message early
+    virtual sfx::sfx_result send_at(const sfx::midi_message& message,unsigned long long due,size_t tag);
+    virtual void cancel(size_t tag);
+    // the number of events released, and how late they were
+    uint32_t released() const;
+    uint32_t max_lateness() const;
+    uint32_t average_lateness() const;
+    void reset_lateness();
+};
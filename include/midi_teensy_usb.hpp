@@ -2,24 +2,98 @@
 #include <Arduino.h>
 #include <USBHost_t36.h>
 #include <sfx.hpp>
+// converts a 32-bit USB-MIDI event packet straight to a message. sysex
+// packets and anything else that isn't a whole message are rejected
+sfx::sfx_result midi_usb_packet_decode(uint32_t packet,sfx::midi_message* out_message);
+// the USB-MIDI code index number for each status byte, or zero if the
+// message can't go out as a single packet, like sysex or a data byte,
+// and for each code, which bytes of the packet carry the message
+struct midi_usb_cin_table final {
+    uint8_t cin[256];
+    uint32_t mask[16];
+    constexpr midi_usb_cin_table() : cin(), mask() {
+        for(int i = 0x80;i<0xF0;++i) {
+            // channel messages use their type
+            cin[i] = uint8_t(i>>4);
+        }
+        cin[0xF1] = 0x2;
+        cin[0xF2] = 0x3;
+        cin[0xF3] = 0x2;
+        cin[0xF6] = 0x5;
+        // a lone end of sysex is one byte, the same as tune request
+        cin[0xF7] = 0x5;
+        for(int i = 0xF8;i<0x100;++i) {
+            cin[i] = 0xF;
+        }
+        // one, two or three bytes, with the data bytes kept to 7 bits
+        mask[0x5] = mask[0xF] = 0x0000FF00;
+        mask[0x2] = mask[0xC] = mask[0xD] = 0x007FFF00;
+        mask[0x3] = mask[0x8] = mask[0x9] = mask[0xA] = mask[0xB] = mask[0xE] = 0x7F7FFF00;
+    }
+};
+constexpr midi_usb_cin_table midi_usb_cins;
+// packs a message laid out as status | data1<<8 | data2<<16, like the
+// sampler's events, into a USB-MIDI event packet for cable 0. returns
+// zero if it can't be sent that way
+inline uint32_t midi_usb_packet_encode(uint32_t message) {
+    uint8_t cin = midi_usb_cins.cin[uint8_t(message)];
+    return cin==0?0:(cin|((message<<8)&midi_usb_cins.mask[cin]));
+}
 class midi_in_teensy_usb_host final : public sfx::midi_input {
     bool m_initialized;
     USBHost m_usb_host;
     MIDIDevice m_in;
     sfx::midi_buffer32 m_buffer;
+    uint32_t m_budget;
     void handle_message(const uint8_t* data,size_t size);
     static void handle_message_s(const uint8_t*data,size_t size,void* state);
+    static void handle_packet_s(uint32_t packet,uint32_t timestamp,void* state);
 public:
-    inline midi_in_teensy_usb_host() : m_initialized(false), m_in(m_usb_host) {}
+    inline midi_in_teensy_usb_host() : m_initialized(false), m_in(m_usb_host), m_budget(500) {}
     virtual sfx::sfx_result receive(sfx::midi_message* out_message);
     sfx::sfx_result initialize();
+    // the most time update() spends reading input, in microseconds
+    inline uint32_t budget() const { return m_budget; }
+    inline void budget(uint32_t value) { m_budget = value; }
+    // the number of times update() ran out of time
+    inline uint32_t budget_hits() { return m_in.getBudgetHits(); }
     void update();
 };
 class midi_out_teensy_usb final : public sfx::midi_output {
     bool m_initialized;
+    bool m_batching;
+    uint32_t m_max_latency;
+    bool m_pending;
+    uint32_t m_pending_ts;
+    sfx::sfx_result send_sysex(const sfx::midi_message& message);
+    void sent();
 public:
-    inline midi_out_teensy_usb() : m_initialized(false) {
+    inline midi_out_teensy_usb() : m_initialized(false), m_batching(false), m_max_latency(1000), m_pending(false), m_pending_ts(0) {
     }
     sfx::sfx_result initialize();
-    virtual sfx::sfx_result send(const sfx::midi_message& message);
+    inline virtual sfx::sfx_result send(const sfx::midi_message& message) {
+        if(message.status==0xF0) {
+            return send_sysex(message);
+        }
+        return send_packed(uint32_t(message.status)|(uint32_t(message.msb())<<8)|(uint32_t(message.lsb())<<16));
+    }
+    // sends a message packed as status | data1<<8 | data2<<16,
+    // going straight to the USB packet without a midi_message
+    inline sfx::sfx_result send_packed(uint32_t message) {
+        uint32_t packet = midi_usb_packet_encode(message);
+        if(packet==0) {
+            return sfx::sfx_result::invalid_format;
+        }
+        usb_midi_write_packed(packet);
+        sent();
+        return sfx::sfx_result::success;
+    }
+    // when batching, messages are packed into the USB buffer
+    // and only go out on flush(), or once the oldest has waited
+    // max_latency microseconds
+    inline bool batching() const { return m_batching; }
+    void batching(bool value);
+    inline uint32_t max_latency() const { return m_max_latency; }
+    inline void max_latency(uint32_t value) { m_max_latency = value; }
+    void flush();
 };
\ No newline at end of file
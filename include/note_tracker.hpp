@@ -1,13 +1,92 @@
 #pragma once
 #include <stdint.h>
+#include <string.h>
 #include <sfx_midi_core.hpp>
 #include <sfx_midi_message.hpp>
+// counts how many trackers hold each note on each channel,
+// so notes shared between them only sound and stop once
+class voice_table final {
+    uint16_t m_counts[16][128];
+    // the total held on each channel
+    uint16_t m_channels[16];
+public:
+    voice_table();
+    // returns true if the note wasn't already sounding
+    bool acquire(uint8_t channel,uint8_t note);
+    // returns true if that was the last hold on the note
+    bool release(uint8_t channel,uint8_t note);
+    inline bool held(uint8_t channel,uint8_t note) const { return m_counts[channel][note]!=0; }
+    inline bool channel_held(uint8_t channel) const { return m_channels[channel]!=0; }
+};
 class note_tracker final {
-    struct {
-        uint32_t bank[4];
-    } m_notes[16];
+    // a bit for each channel with notes held
+    uint16_t m_channels;
+    // a bit for each held note, per channel
+    uint32_t m_notes[16][4];
+    inline bool holds(uint8_t channel,uint8_t note) const { return 0!=(m_notes[channel][note/32]&(uint32_t(1)<<(note%32))); }
+    void hold(uint8_t channel,uint8_t note);
+    void unhold(uint8_t channel,uint8_t note);
 public:
     note_tracker();
-    void process(const sfx::midi_message& message);
-    void send_off(sfx::midi_output& output);
-};
\ No newline at end of file
+    // tracks the message. if voices is given, returns false if the
+    // message shouldn't be sent because another tracker already has
+    // the note sounding, or still needs it
+    bool process(const sfx::midi_message& message,voice_table* voices=nullptr);
+    // releases every held note. if all_notes_off is true it sends
+    // one all notes off (CC 123) per channel instead, which also
+    // silences notes on that channel this tracker didn't start.
+    // with voices, only notes no other tracker holds are stopped,
+    // and all notes off is only sent for channels nothing else holds
+    // output is any type with send(const sfx::midi_message&), such as
+    // a sfx::midi_output. with a final type the sends can be inlined
+    template<typename Output>
+    void send_off(Output& output,bool all_notes_off=false,voice_table* voices=nullptr);
+    // forgets every held note without sending anything
+    void reset(voice_table* voices=nullptr);
+};
+template<typename Output>
+void note_tracker::send_off(Output& output,bool all_notes_off,voice_table* voices) {
+    // only visit the channels and notes that are held
+    uint32_t channels = m_channels;
+    while(channels!=0) {
+        int c = __builtin_ctz(channels);
+        channels&=channels-1;
+        uint32_t* notes = m_notes[c];
+        sfx::midi_message msg;
+        if(voices!=nullptr) {
+            // give our notes back first, to see what still sounds
+            for(int j = 0;j<4;++j) {
+                uint32_t bits = notes[j];
+                uint32_t keep = 0;
+                while(bits!=0) {
+                    uint32_t bit = bits&(~bits+1);
+                    if(!voices->release(uint8_t(c),uint8_t(j*32+__builtin_ctz(bits)))) {
+                        keep|=bit;
+                    }
+                    bits&=bits-1;
+                }
+                // only the notes that were released for good get stopped
+                notes[j]&=~keep;
+            }
+        }
+        if(all_notes_off && (voices==nullptr || !voices->channel_held(uint8_t(c)))) {
+            msg.status = uint8_t(uint8_t(sfx::midi_message_type::control_change)|uint8_t(c));
+            msg.msb(123);
+            msg.lsb(0);
+            output.send(msg);
+        } else {
+            msg.status = uint8_t(uint8_t(sfx::midi_message_type::note_off)|uint8_t(c));
+            for(int j = 0;j<4;++j) {
+                uint32_t bits = notes[j];
+                while(bits!=0) {
+                    msg.msb(uint8_t(j*32+__builtin_ctz(bits)));
+                    msg.lsb(0);
+                    output.send(msg);
+                    bits&=bits-1;
+                }
+            }
+        }
+        memset(notes,0,sizeof(m_notes[0]));
+    }
+    m_channels = 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <Arduino.h>
+#include "clock_source.hpp"
+// a 64-bit microsecond clock with cycle resolution. it combines the
+// millisecond count kept by the existing SysTick interrupt with the
+// DWT cycle counter since the last tick, so it adds no interrupts of
+// its own and never misses a cycle counter wrap
+class teensy_clock final : public clock_source {
+    // extends the 32-bit millisecond count
+    volatile uint32_t m_millis_last;
+    volatile uint32_t m_millis_high;
+public:
+    inline teensy_clock() : m_millis_last(0), m_millis_high(0) {}
+    virtual unsigned long long now();
+};
@@ -1070,9 +1070,9 @@ public:
 		SystemReset           = 0xFF, // System Real Time - System Reset
 	};
 	MIDIDeviceBase(USBHost &host, uint32_t *rx, uint32_t *tx1, uint32_t *tx2,
-		uint16_t bufsize, uint32_t *rqueue, uint16_t qsize) :
+		uint16_t bufsize, uint32_t *rqueue, uint32_t *rtimes, uint16_t qsize) :
 			txtimer(this), rx_buffer(rx), tx_buffer1(tx1), tx_buffer2(tx2),
-			rx_queue(rqueue), max_packet_size(bufsize), rx_queue_size(qsize) {
+			rx_queue(rqueue), rx_times(rtimes), max_packet_size(bufsize), rx_queue_size(qsize) {
 				init();
 		}
 	void sendNoteOff(uint8_t note, uint8_t velocity, uint8_t channel, uint8_t cable=0) {
@@ -1196,6 +1196,13 @@ public:
 	void send_now(void) __attribute__((always_inline)) {
 	}
 	bool read(uint8_t channel=0);
+	// reads everything queued, stopping early once budget
+	// microseconds have passed. returns false if it stopped early
+	bool readAll(uint32_t budget, uint8_t channel=0);
+	// the number of times readAll() ran out of time
+	uint32_t getBudgetHits(void) {
+		return budget_hits;
+	}
 	uint8_t getType(void) {
 		return msg_type;
 	};
@@ -1221,6 +1228,14 @@ public:
 		handleMessage = fptr;
 		handleMessageState = state;
 	}
+	// receives each raw 32-bit USB-MIDI event packet along with the
+	// ARM_DWT_CYCCNT value taken in the USB interrupt when it arrived.
+	// when set it takes the place of the other handlers for everything
+	// but sysex, which is still assembled and passed to handleMessage
+	void setHandlePacket(void (*fptr)(uint32_t packet,uint32_t timestamp,void* state),void* state=nullptr) {
+		handlePacket = fptr;
+		handlePacketState = state;
+	}
 	void setHandleNoteOff(void (*fptr)(uint8_t channel, uint8_t note, uint8_t velocity)) {
 		// type: 0x80  NoteOff
 		handleNoteOff = fptr;
@@ -1342,11 +1357,16 @@ private:
 	uint16_t tx_size;
 	//uint32_t rx_queue[RX_QUEUE_SIZE];
 	uint32_t * const rx_queue;
+	// arrival cycle counts, parallel to rx_queue
+	uint32_t * const rx_times;
 	bool rx_packet_queued;
 	const uint16_t max_packet_size;
 	const uint16_t rx_queue_size;
-	uint16_t rx_head;
-	uint16_t rx_tail;
+	// single producer (rx_data in the USB interrupt)
+	// single consumer (read) so no locking is needed
+	volatile uint16_t rx_head;
+	volatile uint16_t rx_tail;
+	uint32_t budget_hits;
 	volatile uint8_t tx1_count;
 	volatile uint8_t tx2_count;
 	uint8_t rx_ep;
@@ -1362,6 +1382,8 @@ private:
 	uint16_t msg_sysex_len;
 	void* handleMessageState;
 	void (*handleMessage)(const uint8_t* data, size_t size, void* state);
+	void* handlePacketState;
+	void (*handlePacket)(uint32_t packet, uint32_t timestamp, void* state);
 	void (*handleNoteOff)(uint8_t ch, uint8_t note, uint8_t vel);
 	void (*handleNoteOn)(uint8_t ch, uint8_t note, uint8_t vel);
 	void (*handleVelocityChange)(uint8_t ch, uint8_t note, uint8_t vel);
@@ -1390,7 +1412,7 @@ private:
 class MIDIDevice : public MIDIDeviceBase {
 public:
 	MIDIDevice(USBHost &host) :
-		MIDIDeviceBase(host, rx, tx1, tx2, MAX_PACKET_SIZE, queue, RX_QUEUE_SIZE) {};
+		MIDIDeviceBase(host, rx, tx1, tx2, MAX_PACKET_SIZE, queue, queue_times, RX_QUEUE_SIZE) {};
 	// MIDIDevice(USBHost *host) : ....
 private:
 	enum { MAX_PACKET_SIZE = 64 };
@@ -1399,12 +1421,13 @@ private:
 	uint32_t tx1[MAX_PACKET_SIZE/4];
 	uint32_t tx2[MAX_PACKET_SIZE/4];
 	uint32_t queue[RX_QUEUE_SIZE];
+	uint32_t queue_times[RX_QUEUE_SIZE];
 };
 
 class MIDIDevice_BigBuffer : public MIDIDeviceBase {
 public:
 	MIDIDevice_BigBuffer(USBHost &host) :
-		MIDIDeviceBase(host, rx, tx1, tx2, MAX_PACKET_SIZE, queue, RX_QUEUE_SIZE) {};
+		MIDIDeviceBase(host, rx, tx1, tx2, MAX_PACKET_SIZE, queue, queue_times, RX_QUEUE_SIZE) {};
 	// MIDIDevice(USBHost *host) : ....
 private:
 	enum { MAX_PACKET_SIZE = 512 };
@@ -1413,6 +1436,7 @@ private:
 	uint32_t tx1[MAX_PACKET_SIZE/4];
 	uint32_t tx2[MAX_PACKET_SIZE/4];
 	uint32_t queue[RX_QUEUE_SIZE];
+	uint32_t queue_times[RX_QUEUE_SIZE];
 };
 
 
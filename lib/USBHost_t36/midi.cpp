@@ -36,6 +36,8 @@ void MIDIDeviceBase::init()
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
 	handleMessage = NULL;
 	handleMessageState = NULL;
+	handlePacket = NULL;
+	handlePacketState = NULL;
 	handleNoteOff = NULL;
 	handleNoteOn = NULL;
 	handleVelocityChange = NULL;
@@ -58,6 +60,7 @@ void MIDIDeviceBase::init()
 	handleRealTimeSystem = NULL;
 	rx_head = 0;
 	rx_tail = 0;
+	budget_hits = 0;
 	rxpipe = NULL;
 	txpipe = NULL;
 	driver_ready_for_device(this);
@@ -243,6 +246,8 @@ void MIDIDeviceBase::rx_data(const Transfer_t *transfer)
 	print("  MIDI Data: ");
 	uint32_t len = (transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF)) >> 2;
 	print_hexbytes(transfer->buffer, len * 4);
+	// everything in one transfer arrived together
+	uint32_t now = ARM_DWT_CYCCNT;
 	uint32_t head = rx_head;
 	uint32_t tail = rx_tail;
 	for (uint32_t i=0; i < len; i++) {
@@ -250,10 +255,10 @@ void MIDIDeviceBase::rx_data(const Transfer_t *transfer)
 		if (msg) {
 			if (++head >= rx_queue_size) head = 0;
 			rx_queue[head] = msg;
+			rx_times[head] = now;
 		}
 	}
 	rx_head = head;
-	rx_tail = tail;
 	uint32_t avail = (head < tail) ? tail - head - 1 : rx_queue_size - 1 - head + tail;
 	//println("rx_size = ", rx_size);
 	println("avail = ", avail);
@@ -396,26 +401,49 @@ void MIDIDeviceBase::send_sysex_add_term_bytes(const uint8_t *data, uint32_t len
 
 
 
+bool MIDIDeviceBase::readAll(uint32_t budget, uint8_t channel)
+{
+	uint32_t start = micros();
+	while (rx_head != rx_tail) {
+		read(channel);
+		if (rx_head != rx_tail && micros() - start >= budget) {
+			++budget_hits;
+			return false;
+		}
+	}
+	return true;
+}
+
 bool MIDIDeviceBase::read(uint8_t channel)
 {
-	uint32_t n, head, tail, avail, ch, type1, type2, b1;
+	uint32_t n, ts, head, tail, avail, ch, type1, type2, b1;
 
 	head = rx_head;
 	tail = rx_tail;
 	if (head == tail) return false;
 	if (++tail >= rx_queue_size) tail = 0;
 	n = rx_queue[tail];
+	ts = rx_times[tail];
 	rx_tail = tail;
 	if (!rx_packet_queued && rxpipe) {
 	        avail = (head < tail) ? tail - head - 1 : rx_queue_size - 1 - head + tail;
 		if (avail >= (uint32_t)(rx_size>>2)) {
+			// re-arm as soon as there's room so the
+			// device isn't left NAKing
 			__disable_irq();
 			queue_Data_Transfer(rxpipe, rx_buffer, rx_size, this);
+			rx_packet_queued = true;
 			__enable_irq();
 		}
 	}
 	println("read: ", n, HEX);
 
+	if (handlePacket && ((n & 15) < 0x04 || (n & 15) > 0x07)) {
+		// hand it over as is. no unpacking
+		msg_cable = (n >> 4) & 15;
+		(*handlePacket)(n, ts, handlePacketState);
+		return true;
+	}
 	type1 = n & 15;
 	type2 = (n >> 12) & 15;
 	b1 = (n >> 8) & 0xFF;
@@ -40,9 +40,12 @@
 #include <htcw_button.hpp>
 #include <sfx.hpp>
 #include <gfx_cpp14.hpp>
+#include "memory_arena.hpp"
 #include "midi_quantizer.hpp"
 #include "midi_sampler.hpp"
 #include "midi_teensy_usb.hpp"
+#include "midi_teensy_scheduler.hpp"
+#include "teensy_clock.hpp"
 #include "telegrama.hpp"
 #include "PaulMaul.hpp"
 #include "MIDI.hpp"
@@ -51,10 +54,22 @@ using namespace arduino;
 using namespace sfx;
 using namespace gfx;
 
+struct midi_track_info final {
+    uint32_t notes;
+    // a bit for each channel the track uses
+    uint16_t channels;
+    // the most notes held at once
+    uint16_t polyphony;
+};
 struct midi_file_info final {
     int type;
     int tracks;
     int32_t microtempo;
+    // the length, following every tempo change
+    uint32_t milliseconds;
+    uint32_t notes;
+    // the index of the first of this file's tracks in track_infos
+    size_t track_info;
 };
 
 using lcd_bus_t = tft_spi<LCD_HOST,LCD_CS>;
@@ -62,20 +77,25 @@ using lcd_t = ili9341<LCD_DC,LCD_RST,LCD_BKL,lcd_bus_t,LCD_ROTATION,true,400,200
 
 using color_t = color<typename lcd_t::pixel_type>;
 
-#ifdef HIGH_PRECISION
-// stuff for making _gettimeofday() and std::chrono work
-volatile uint64_t chrono_tick_count;
-void chrono_tick() {
-    ++chrono_tick_count;
-}
-IntervalTimer chrono_timer;
-#endif // HIGH_PRECISION
+// drives the sampler, and backs _gettimeofday()
+teensy_clock precise_clock;
 
 USBHost usb_host;
 
 MIDIDevice midi_dev(usb_host);
+// how long each pass of loop() may spend on MIDI input, in microseconds
+uint32_t input_budget = 500;
 
 midi_out_teensy_usb midi_out;
+// sends to midi_out from a timer interrupt, so events go out on time
+// no matter what loop() is doing. the sampler renders this far ahead
+midi_scheduler_teensy scheduler;
+uint32_t lookahead = 3000;
+// build with -DPRANG_DIAGNOSTICS to report timing
+// and memory use over the serial port
+#ifdef PRANG_DIAGNOSTICS
+uint32_t reported_lateness;
+#endif
 
 lcd_t lcd;
 
@@ -84,16 +104,68 @@ Encoder encoder(ENC_CLK,ENC_DATA);
 button<BUTTON_A> button_a;
 button<BUTTON_B> button_b;
 
+// the song and everything that goes with it are allocated from
+// here, and thrown away all at once when another song is loaded
+#ifndef SONG_MEMORY_SIZE
+#define SONG_MEMORY_SIZE (256 * 1024)
+#endif
+DMAMEM static uint8_t song_memory[SONG_MEMORY_SIZE];
+memory_arena song_arena(song_memory, sizeof(song_memory));
 midi_sampler sampler;
 midi_quantizer quantizer;
 
 midi_quantizer_timing last_timing;
 uint32_t last_timing_ts;
 
+// the playing screen is only drawn from render_ui() in loop().
+// everything else just marks what changed
+bool timing_dirty;
+bool tempo_dirty;
+// where the tempo multiplier text was last drawn
+srect16 tempo_rect;
+// how far into each pass of loop() drawing may start, in microseconds
+uint32_t ui_budget = 2000;
+// how long each slice of the file browser's background scan may take
+uint32_t scan_budget = 2000;
+
 File file;
+// only used when a song is too big to fit in RAM
+file_stream* song_stream = nullptr;
 
 midi_file_info file_info;
 
+// a block of memory that grows as it's filled. only used at boot
+struct boot_buffer final {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+};
+// the per track scan results for every file
+boot_buffer track_infos;
+// one entry per MIDI file on the card
+struct file_entry final {
+    // offset of the full path in file_names
+    uint32_t name;
+    uint32_t size;
+    uint32_t mtime;
+    // false until the file has been looked up or scanned
+    bool scanned;
+    midi_file_info info;
+};
+enum struct file_sort {
+    name = 0,
+    tempo
+};
+// the file table, and the paths it points into
+boot_buffer file_entries;
+boot_buffer file_names;
+file_sort file_sort_by = file_sort::name;
+// how many files still need scanning, and where to look for the next one
+size_t scan_pending_count;
+size_t scan_failed_count;
+size_t scan_next;
+static const size_t max_path = 256;
+
 int base_octave;
 int quantize_beats;
 float tempo_multiplier;
@@ -101,77 +173,692 @@ float tempo_multiplier;
 uint32_t off_ts;
 int64_t encoder_old_count;
 
-sfx_result scan_file(File& file, midi_file_info* out_info) {
-    midi_file mf;
-    file_stream fs(file);
-    size_t len = (size_t)fs.seek(0,seek_origin::end);
-    fs.seek(0);
-    uint8_t* buffer = (uint8_t*)malloc(len);
-    if(buffer!=nullptr) {
-        fs.read(buffer,len);
-    }
-    const_buffer_stream bs(buffer,len);
-    stream& stm = buffer==nullptr?(stream&)fs:bs;
-    sfx_result r = midi_file::read(stm, &mf);
-    if (r != sfx_result::success) {
-        if(buffer!=nullptr) {
-            free(buffer);
+// scan_file() reads through this one block aligned buffer
+// so the SD sees large sequential reads
+static const size_t scan_buffer_size = 4096;
+static uint8_t scan_buffer[scan_buffer_size];
+struct scan_reader final {
+    File* file;
+    // the file offset of scan_buffer[0]
+    uint32_t base;
+    size_t size;
+    size_t pos;
+};
+static void scan_seek(scan_reader& r, uint32_t offset) {
+    if (offset >= r.base && offset < r.base + r.size) {
+        r.pos = offset - r.base;
+        return;
+    }
+    // leave it to scan_getch() to read the block on demand
+    r.base = offset & ~uint32_t(scan_buffer_size - 1);
+    r.size = 0;
+    r.pos = offset - r.base;
+}
+static inline uint32_t scan_tell(const scan_reader& r) {
+    return r.base + r.pos;
+}
+static int scan_getch(scan_reader& r) {
+    if (r.pos >= r.size) {
+        uint32_t offset = scan_tell(r);
+        uint32_t base = offset & ~uint32_t(scan_buffer_size - 1);
+        if (base == r.base && r.size != 0 && r.size < scan_buffer_size) {
+            // a short block, so this is past the end of the file
+            return -1;
+        }
+        // read the whole block holding offset
+        r.base = base;
+        r.pos = offset - base;
+        if (!r.file->seek(base)) {
+            return -1;
+        }
+        int read = r.file->read(scan_buffer, scan_buffer_size);
+        r.size = read < 0 ? 0 : (size_t)read;
+        if (r.pos >= r.size) {
+            return -1;
         }
-        return r;
     }
-    out_info->tracks = (int)mf.tracks_size;
-    int32_t file_mt = 500000;
-    for (size_t i = 0; i < mf.tracks_size; ++i) {
-        if (mf.tracks[i].offset != stm.seek(mf.tracks[i].offset)) {
-            if(buffer!=nullptr) {
-                free(buffer);
-            }
+    return scan_buffer[r.pos++];
+}
+static bool scan_read(scan_reader& r, uint8_t* data, size_t size) {
+    while (size--) {
+        int ch = scan_getch(r);
+        if (ch < 0) {
+            return false;
+        }
+        *data++ = (uint8_t)ch;
+    }
+    return true;
+}
+static bool scan_read32(scan_reader& r, uint32_t* out_value) {
+    uint8_t b[4];
+    if (!scan_read(r, b, 4)) {
+        return false;
+    }
+    *out_value = (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | b[3];
+    return true;
+}
+static bool scan_varlen(scan_reader& r, uint32_t* out_value) {
+    uint32_t result = 0;
+    for (int i = 0; i < 4; ++i) {
+        int ch = scan_getch(r);
+        if (ch < 0) {
+            return false;
+        }
+        result = (result << 7) | (ch & 0x7F);
+        if (!(ch & 0x80)) {
+            *out_value = result;
+            return true;
+        }
+    }
+    return false;
+}
+// makes room for size more bytes, returning where they go
+static uint8_t* boot_reserve(boot_buffer& b, size_t size) {
+    if (b.size + size > b.capacity) {
+        size_t capacity = b.capacity ? b.capacity : 1024;
+        while (capacity < b.size + size) {
+            capacity *= 2;
+        }
+        uint8_t* data = (uint8_t*)realloc(b.data, capacity);
+        if (data == nullptr) {
+            return nullptr;
+        }
+        b.data = data;
+        b.capacity = capacity;
+    }
+    return b.data + b.size;
+}
+static void boot_free(boot_buffer& b) {
+    if (b.data != nullptr) {
+        free(b.data);
+    }
+    b.data = nullptr;
+    b.size = 0;
+    b.capacity = 0;
+}
+// the tempo changes of the file being scanned, for working out its length
+struct scan_tempo final {
+    uint32_t tick;
+    int32_t microtempo;
+};
+static const size_t scan_tempos_size = 1024;
+static scan_tempo scan_tempos[scan_tempos_size];
+// the notes held in the track being scanned, 128 bits per channel
+static uint32_t scan_notes[16 * 4];
+static uint32_t scan_milliseconds(size_t tempos_size, uint32_t end_tick, int16_t timebase) {
+    // they only need sorting in the rare case where tempo
+    // changes are spread over more than one track
+    for (size_t i = 1; i < tempos_size; ++i) {
+        scan_tempo t = scan_tempos[i];
+        size_t j = i;
+        while (j > 0 && scan_tempos[j - 1].tick > t.tick) {
+            scan_tempos[j] = scan_tempos[j - 1];
+            --j;
+        }
+        scan_tempos[j] = t;
+    }
+    unsigned long long us = 0;
+    uint32_t tick = 0;
+    int32_t mt = 500000;
+    for (size_t i = 0; i < tempos_size && scan_tempos[i].tick < end_tick; ++i) {
+        us += (unsigned long long)(scan_tempos[i].tick - tick) * mt / timebase;
+        tick = scan_tempos[i].tick;
+        mt = scan_tempos[i].microtempo;
+    }
+    us += (unsigned long long)(end_tick - tick) * mt / timebase;
+    return (uint32_t)(us / 1000);
+}
+// a file part way through being scanned. scan_file() gets as far
+// as it can in the time it's given and picks up from here next call
+struct scan_state final {
+    File file;
+    scan_reader reader;
+    // 0 until the header has been read
+    uint32_t chunk;
+    uint32_t file_size;
+    int type;
+    int16_t timebase;
+    size_t tracks_size;
+    size_t tracks;
+    // the index of the first of this file's tracks in track_infos
+    size_t track_info;
+    // the tempo if every tempo change agrees, otherwise 0
+    int32_t file_mt;
+    size_t tempos_size;
+    uint32_t end_tick;
+    uint32_t notes;
+    // the track being read, if track_end isn't 0
+    uint32_t track_end;
+    uint32_t tick;
+    uint8_t running;
+    uint16_t held;
+};
+// only one file is scanned at a time
+static scan_state scan;
+// the name of the file being scanned, if scanning is set
+static bool scanning;
+static uint32_t scan_name;
+// how often scan_file() checks the time, in events
+static const size_t scan_check_events = 64;
+static void scan_begin(scan_state& s) {
+    s.reader.file = &s.file;
+    s.reader.base = 0;
+    s.reader.size = 0;
+    s.reader.pos = 0;
+    s.chunk = 0;
+    s.track_end = 0;
+}
+// gets everything the file browser shows without loading the file.
+// returns timeout if budget microseconds pass before it's done, in
+// which case calling it again carries on where it left off
+sfx_result scan_file(scan_state& s, uint32_t budget, midi_file_info* out_info) {
+    uint32_t start = micros();
+    scan_reader& r = s.reader;
+    if (s.chunk == 0) {
+        uint8_t hdr[14];
+        if (!scan_read(r, hdr, sizeof(hdr))) {
             return sfx_result::end_of_stream;
         }
-        bool found_tempo = false;
-        int32_t mt = 500000;
-        midi_event_ex me;
-        me.absolute = 0;
-        me.delta = 0;
-        while (stm.seek(0, seek_origin::current) < mf.tracks[i].size) {
-            size_t sz = midi_stream::decode_event(true, stm, &me);
-            if (sz == 0) {
-                if(buffer!=nullptr) {
-                    free(buffer);
+        uint32_t hdr_size = (uint32_t(hdr[4]) << 24) | (uint32_t(hdr[5]) << 16) | (uint32_t(hdr[6]) << 8) | hdr[7];
+        s.timebase = (int16_t)((hdr[12] << 8) | hdr[13]);
+        if (0 != memcmp(hdr, "MThd", 4) || hdr_size < 6 || s.timebase <= 0) {
+            return sfx_result::invalid_format;
+        }
+        s.type = (hdr[8] << 8) | hdr[9];
+        s.tracks_size = (hdr[10] << 8) | hdr[11];
+        // reserved now, but only claimed once the scan is done
+        if (nullptr == boot_reserve(track_infos, s.tracks_size * sizeof(midi_track_info))) {
+            return sfx_result::out_of_memory;
+        }
+        s.track_info = track_infos.size / sizeof(midi_track_info);
+        s.file_size = (uint32_t)s.file.size();
+        s.chunk = 8 + hdr_size;
+        s.tracks = 0;
+        s.file_mt = 500000;
+        s.tempos_size = 0;
+        s.end_tick = 0;
+        s.notes = 0;
+    }
+    midi_track_info* infos = (midi_track_info*)track_infos.data + s.track_info;
+    size_t events = 0;
+    while (s.track_end != 0 || (s.tracks < s.tracks_size && s.chunk + 8 <= s.file_size)) {
+        if (s.track_end == 0) {
+            scan_seek(r, s.chunk);
+            uint8_t id[4];
+            uint32_t size;
+            if (!scan_read(r, id, 4) || !scan_read32(r, &size)) {
+                return sfx_result::end_of_stream;
+            }
+            // skip straight to the next chunk after this one
+            s.chunk += 8 + size;
+            if (0 != memcmp(id, "MTrk", 4)) {
+                continue;
+            }
+            midi_track_info& info = infos[s.tracks];
+            info.notes = 0;
+            info.channels = 0;
+            info.polyphony = 0;
+            s.held = 0;
+            memset(scan_notes, 0, sizeof(scan_notes));
+            s.tick = 0;
+            s.running = 0;
+            s.track_end = s.chunk;
+        }
+        midi_track_info& info = infos[s.tracks];
+        bool track_done = true;
+        while (scan_tell(r) < s.track_end) {
+            if (++events == scan_check_events) {
+                events = 0;
+                if (micros() - start >= budget) {
+                    track_done = false;
+                    break;
                 }
+            }
+            uint32_t delta;
+            if (!scan_varlen(r, &delta)) {
                 return sfx_result::unknown_error;
             }
-            if (me.message.status == 0xFF && me.message.meta.type == 0x51) {
-                int32_t mt2 = (me.message.meta.data[0] << 16) |
-                              (me.message.meta.data[1] << 8) |
-                              me.message.meta.data[2];
-                if (!found_tempo) {
-                    found_tempo = true;
-                    mt = mt2;
-                    file_mt = mt;
-                } else {
-                    if (mt != file_mt) {
-                        mt = 0;
-                        file_mt = 0;
-                        break;
+            s.tick += delta;
+            int ch = scan_getch(r);
+            if (ch < 0) {
+                return sfx_result::unknown_error;
+            }
+            uint8_t status = (uint8_t)ch;
+            uint8_t data[2];
+            if (status < 0xF0) {
+                size_t i = 0;
+                if (status < 0x80) {
+                    // running status, so that was the first data byte
+                    if (s.running == 0) {
+                        return sfx_result::unknown_error;
                     }
-                    if (mt != mt2) {
-                        mt = 0;
-                        file_mt = 0;
-                        break;
+                    data[i++] = status;
+                    status = s.running;
+                }
+                s.running = status;
+                uint8_t kind = status & 0xF0;
+                size_t data_size = (kind == 0xC0 || kind == 0xD0) ? 1 : 2;
+                if (!scan_read(r, data + i, data_size - i)) {
+                    return sfx_result::unknown_error;
+                }
+                uint8_t chan = status & 0x0F;
+                info.channels |= 1 << chan;
+                if (kind == 0x90 || kind == 0x80) {
+                    uint32_t& bank = scan_notes[chan * 4 + ((data[0] & 0x7F) >> 5)];
+                    uint32_t mask = uint32_t(1) << (data[0] & 31);
+                    if (kind == 0x90 && data[1] != 0) {
+                        ++info.notes;
+                        if (!(bank & mask)) {
+                            bank |= mask;
+                            if (++s.held > info.polyphony) {
+                                info.polyphony = s.held;
+                            }
+                        }
+                    } else if (bank & mask) {
+                        bank &= ~mask;
+                        --s.held;
                     }
                 }
+                continue;
+            }
+            uint32_t skip;
+            if (status == 0xFF) {
+                int meta = scan_getch(r);
+                uint32_t len;
+                if (meta < 0 || !scan_varlen(r, &len)) {
+                    return sfx_result::unknown_error;
+                }
+                if (meta == 0x2F) {
+                    // end of track
+                    break;
+                }
+                skip = len;
+                if (meta == 0x51 && len == 3) {
+                    uint8_t b[3];
+                    if (!scan_read(r, b, 3)) {
+                        return sfx_result::unknown_error;
+                    }
+                    int32_t mt = (b[0] << 16) | (b[1] << 8) | b[2];
+                    if (s.tempos_size == 0) {
+                        s.file_mt = mt;
+                    } else if (mt != s.file_mt) {
+                        s.file_mt = 0;
+                    }
+                    // past this many the length is approximate
+                    if (s.tempos_size < scan_tempos_size) {
+                        scan_tempos[s.tempos_size].tick = s.tick;
+                        scan_tempos[s.tempos_size].microtempo = mt;
+                        ++s.tempos_size;
+                    }
+                    skip = 0;
+                }
+            } else if (status == 0xF0 || status == 0xF7) {
+                if (!scan_varlen(r, &skip)) {
+                    return sfx_result::unknown_error;
+                }
+            } else {
+                // system common messages don't belong in a file
+                return sfx_result::unknown_error;
+            }
+            if (skip) {
+                scan_seek(r, scan_tell(r) + skip);
+            }
+        }
+        if (!track_done) {
+            return sfx_result::timeout;
+        }
+        s.track_end = 0;
+        if (s.tick > s.end_tick) {
+            s.end_tick = s.tick;
+        }
+        s.notes += info.notes;
+        ++s.tracks;
+        if (micros() - start >= budget) {
+            // there's more to do, unless that was the last one
+            if (s.tracks < s.tracks_size && s.chunk + 8 <= s.file_size) {
+                return sfx_result::timeout;
             }
         }
     }
-    out_info->microtempo = file_mt;
-    out_info->type = mf.type;
-    if(buffer!=nullptr) {
-        free(buffer);
-    }
+    out_info->tracks = (int)s.tracks;
+    out_info->microtempo = s.file_mt;
+    out_info->type = s.type;
+    out_info->milliseconds = scan_milliseconds(s.tempos_size, s.end_tick, s.timebase);
+    out_info->notes = s.notes;
+    out_info->track_info = s.track_info;
+    track_infos.size += s.tracks * sizeof(midi_track_info);
     return sfx_result::success;
 }
 
+// the scan results are kept in /prang.idx so files that haven't
+// changed aren't decoded again on the next boot. it's a header
+// (magic, record count) followed by the records, each being the
+// file size, the modified time, the midi_file_info fields and the
+// name length, followed by the name and then the midi_track_info
+// fields for each track. all little endian
+static const uint32_t index_magic = 0x32444950; // PID2
+static const size_t index_header_size = 8;
+static const size_t index_record_size = 30;
+static const size_t index_track_size = 8;
+static uint32_t file_mtime(File& f) {
+    DateTimeFields tm;
+    if (!f.getModifyTime(tm)) {
+        return 0;
+    }
+    // packed like a FAT timestamp
+    return (uint32_t(tm.year - 80) << 25) | (uint32_t(tm.mon + 1) << 21) |
+           (uint32_t(tm.mday) << 16) | (uint32_t(tm.hour) << 11) |
+           (uint32_t(tm.min) << 5) | (tm.sec >> 1);
+}
+static uint8_t* load_index(size_t* out_size) {
+    // a leftover temp file means we lost power between
+    // removing the old index and renaming the new one
+    const char* path = SD.exists("/prang.idx") ? "/prang.idx" : "/prang.tmp";
+    File f = SD.open(path);
+    if (!f) {
+        return nullptr;
+    }
+    size_t size = (size_t)f.size();
+    uint8_t* result = size >= index_header_size ? (uint8_t*)malloc(size) : nullptr;
+    if (result != nullptr) {
+        uint32_t magic = 0;
+        if (size == (size_t)f.read(result, size)) {
+            memcpy(&magic, result, 4);
+        }
+        if (magic != index_magic) {
+            free(result);
+            result = nullptr;
+        }
+    }
+    f.close();
+    *out_size = size;
+    return result;
+}
+// looks for the file in the old index, starting where the last
+// match left off since the directory order rarely changes
+static bool find_index(const uint8_t* index, size_t index_size, size_t* cursor, const char* name, size_t name_size, uint32_t size, uint32_t mtime, midi_file_info* out_info) {
+    if (index == nullptr) {
+        return false;
+    }
+    size_t start = *cursor < index_header_size ? index_header_size : *cursor;
+    size_t pos = start;
+    bool wrapped = false;
+    while (true) {
+        if (pos + index_record_size > index_size) {
+            if (wrapped) {
+                return false;
+            }
+            wrapped = true;
+            pos = index_header_size;
+        }
+        if (wrapped && pos >= start) {
+            return false;
+        }
+        uint32_t rsize, rmtime;
+        int32_t rtracks;
+        uint16_t rname_size;
+        memcpy(&rsize, index + pos, 4);
+        memcpy(&rmtime, index + pos + 4, 4);
+        memcpy(&rtracks, index + pos + 12, 4);
+        memcpy(&rname_size, index + pos + 28, 2);
+        size_t tracks_pos = pos + index_record_size + rname_size;
+        size_t next = tracks_pos + (size_t)rtracks * index_track_size;
+        if (rtracks < 0 || next > index_size) {
+            // corrupt, so act like it ended here
+            index_size = pos;
+            continue;
+        }
+        if (rname_size == name_size && rsize == size && rmtime == mtime &&
+            0 == memcmp(index + pos + index_record_size, name, name_size)) {
+            midi_track_info* infos = (midi_track_info*)boot_reserve(track_infos, rtracks * sizeof(midi_track_info));
+            if (infos == nullptr) {
+                return false;
+            }
+            int32_t v;
+            memcpy(&v, index + pos + 8, 4);
+            out_info->type = v;
+            out_info->tracks = rtracks;
+            memcpy(&v, index + pos + 16, 4);
+            out_info->microtempo = v;
+            memcpy(&out_info->milliseconds, index + pos + 20, 4);
+            memcpy(&out_info->notes, index + pos + 24, 4);
+            for (int32_t i = 0; i < rtracks; ++i) {
+                const uint8_t* p = index + tracks_pos + i * index_track_size;
+                memcpy(&infos[i].notes, p, 4);
+                memcpy(&infos[i].channels, p + 4, 2);
+                memcpy(&infos[i].polyphony, p + 6, 2);
+            }
+            out_info->track_info = track_infos.size / sizeof(midi_track_info);
+            track_infos.size += rtracks * sizeof(midi_track_info);
+            *cursor = next;
+            return true;
+        }
+        pos = next;
+    }
+}
+static bool put_index(boot_buffer& index, const char* name, size_t name_size, uint32_t size, uint32_t mtime, const midi_file_info& info) {
+    size_t tracks = info.type < 0 ? 0 : (size_t)info.tracks;
+    uint8_t* p = boot_reserve(index, index_record_size + name_size + tracks * index_track_size);
+    if (p == nullptr) {
+        return false;
+    }
+    int32_t v;
+    uint16_t ns = (uint16_t)name_size;
+    memcpy(p, &size, 4);
+    memcpy(p + 4, &mtime, 4);
+    v = info.type;
+    memcpy(p + 8, &v, 4);
+    v = (int32_t)tracks;
+    memcpy(p + 12, &v, 4);
+    v = info.microtempo;
+    memcpy(p + 16, &v, 4);
+    memcpy(p + 20, &info.milliseconds, 4);
+    memcpy(p + 24, &info.notes, 4);
+    memcpy(p + 28, &ns, 2);
+    memcpy(p + index_record_size, name, name_size);
+    p += index_record_size + name_size;
+    const midi_track_info* infos = (const midi_track_info*)track_infos.data + info.track_info;
+    for (size_t i = 0; i < tracks; ++i) {
+        memcpy(p, &infos[i].notes, 4);
+        memcpy(p + 4, &infos[i].channels, 2);
+        memcpy(p + 6, &infos[i].polyphony, 2);
+        p += index_track_size;
+    }
+    index.size += index_record_size + name_size + tracks * index_track_size;
+    return true;
+}
+static void save_index(const uint8_t* index, size_t size) {
+    // write it out in full before swapping it in,
+    // so the old index survives a failure
+    if (SD.exists("/prang.tmp")) {
+        SD.remove("/prang.tmp");
+    }
+    File f = SD.open("/prang.tmp", FILE_WRITE);
+    if (!f) {
+        return;
+    }
+    bool ok = size == (size_t)f.write(index, size);
+    f.close();
+    if (!ok) {
+        SD.remove("/prang.tmp");
+        return;
+    }
+    if (SD.exists("/prang.idx")) {
+        SD.remove("/prang.idx");
+    }
+    SD.rename("/prang.tmp", "/prang.idx");
+}
+static inline const char* file_name(const file_entry& e) {
+    return (const char*)file_names.data + e.name;
+}
+static bool is_midi_file(const char* fn, size_t fnl) {
+    return (fnl > 5 && 0 == strcasecmp(".midi", fn + fnl - 5)) ||
+           (fnl > 4 && 0 == strcasecmp(".mid", fn + fnl - 4));
+}
+// adds every MIDI file under dir to the file table.
+// path holds dir's path, path_size long
+static bool collect_files(File& dir, char* path, size_t path_size) {
+    while (true) {
+        File f = dir.openNextFile();
+        if (!f) {
+            break;
+        }
+        const char* fn = f.name();
+        size_t fnl = strlen(fn);
+        if (path_size + fnl + 2 > max_path) {
+            // too deep. skip it
+            f.close();
+            continue;
+        }
+        if (f.isDirectory()) {
+            path[path_size] = '/';
+            memcpy(path + path_size + 1, fn, fnl + 1);
+            bool result = collect_files(f, path, path_size + fnl + 1);
+            path[path_size] = 0;
+            if (!result) {
+                f.close();
+                return false;
+            }
+        } else if (is_midi_file(fn, fnl)) {
+            file_entry* e = (file_entry*)boot_reserve(file_entries, sizeof(file_entry));
+            char* str = (char*)boot_reserve(file_names, path_size + fnl + 2);
+            if (e == nullptr || str == nullptr) {
+                f.close();
+                return false;
+            }
+            e->name = (uint32_t)file_names.size;
+            e->size = (uint32_t)f.size();
+            e->mtime = file_mtime(f);
+            e->scanned = false;
+            memset(&e->info, 0, sizeof(midi_file_info));
+            memcpy(str, path, path_size);
+            str[path_size] = '/';
+            memcpy(str + path_size + 1, fn, fnl + 1);
+            file_entries.size += sizeof(file_entry);
+            file_names.size += path_size + fnl + 2;
+        }
+        f.close();
+    }
+    return true;
+}
+static int file_compare_name(const void* lhs, const void* rhs) {
+    return strcasecmp(file_name(*(const file_entry*)lhs), file_name(*(const file_entry*)rhs));
+}
+static int file_compare_tempo(const void* lhs, const void* rhs) {
+    // faster first, and files with tempo changes last,
+    // followed by the ones that haven't been scanned yet
+    const file_entry& le = *(const file_entry*)lhs;
+    const file_entry& re = *(const file_entry*)rhs;
+    if (le.scanned != re.scanned) {
+        return le.scanned ? -1 : 1;
+    }
+    int32_t lmt = le.info.microtempo;
+    int32_t rmt = re.info.microtempo;
+    if (lmt != rmt) {
+        if (lmt == 0) {
+            return 1;
+        }
+        if (rmt == 0) {
+            return -1;
+        }
+        return lmt < rmt ? -1 : 1;
+    }
+    return file_compare_name(lhs, rhs);
+}
+static void sort_files(file_sort by) {
+    file_sort_by = by;
+    qsort(file_entries.data, file_entries.size / sizeof(file_entry), sizeof(file_entry),
+          by == file_sort::tempo ? file_compare_tempo : file_compare_name);
+}
+static int file_compare_walk(const void* lhs, const void* rhs) {
+    // paths were added in the order the card was walked
+    uint32_t ln = ((const file_entry*)lhs)->name;
+    uint32_t rn = ((const file_entry*)rhs)->name;
+    return ln < rn ? -1 : ln > rn;
+}
+// scans e for up to budget microseconds, returning true once it's done
+static bool scan_entry(file_entry& e, uint32_t budget = 0xFFFFFFFF) {
+    if (!scanning || scan_name != e.name) {
+        // anything else that was part way through starts over later
+        if (scan.file) {
+            scan.file.close();
+        }
+        scan_begin(scan);
+        scan.file = SD.open(file_name(e));
+        scan_name = e.name;
+        scanning = true;
+    }
+    sfx_result r = scan.file ? scan_file(scan, budget, &e.info) : sfx_result::io_error;
+    if (r == sfx_result::timeout) {
+        return false;
+    }
+    if (r != sfx_result::success) {
+        // remember the failures too
+        e.info.type = -1;
+        e.info.tracks = 0;
+        e.info.microtempo = 0;
+        e.info.milliseconds = 0;
+        e.info.notes = 0;
+        e.info.track_info = 0;
+        ++scan_failed_count;
+        Serial.println("Failed to scan file");
+    }
+    if (scan.file) {
+        scan.file.close();
+    }
+    scanning = false;
+    e.scanned = true;
+    --scan_pending_count;
+    return true;
+}
+// scans for up to scan_budget microseconds, starting on the file at
+// cursor if it needs it, otherwise carrying on with the one already
+// started. returns the index of the file it worked on, or -1 if there
+// are none left
+static int scan_pending(size_t cursor) {
+    if (scan_pending_count == 0) {
+        return -1;
+    }
+    file_entry* entries = (file_entry*)file_entries.data;
+    size_t count = file_entries.size / sizeof(file_entry);
+    size_t i = cursor;
+    if (entries[i].scanned) {
+        i = count;
+        if (scanning) {
+            // sorting may have moved it
+            for (size_t j = 0; j < count; ++j) {
+                if (entries[j].name == scan_name) {
+                    i = j;
+                    break;
+                }
+            }
+        }
+        if (i == count) {
+            i = scan_next < count ? scan_next : 0;
+            while (entries[i].scanned) {
+                if (++i == count) {
+                    i = 0;
+                }
+            }
+            scan_next = i + 1;
+        }
+    }
+    scan_entry(entries[i], scan_budget);
+    return (int)i;
+}
+// moves to the next readable file in the given direction, if there is one
+static size_t step_file(size_t index, bool forward) {
+    const file_entry* entries = (const file_entry*)file_entries.data;
+    size_t count = file_entries.size / sizeof(file_entry);
+    size_t i = index;
+    while (forward ? i < count - 1 : i > 0) {
+        i = forward ? i + 1 : i - 1;
+        if (entries[i].info.type >= 0 || !entries[i].scanned) {
+            return i;
+        }
+    }
+    return index;
+}
 static void draw_error(const char* text) {
     draw::filled_rectangle(lcd, lcd.bounds(), color_t::white);
     
@@ -192,6 +879,21 @@ void wait_and_restart() {
 }
 void update_tempo_mult() {
     sampler.tempo_multiplier(tempo_multiplier);
+    // any number of changes before the next render draw once
+    tempo_dirty = true;
+}
+static void draw_timing() {
+    auto px = color_t::white;
+    if(last_timing==midi_quantizer_timing::exact) {
+        px = color_t::green;
+    } else if(last_timing==midi_quantizer_timing::early) {
+        px = color_t::blue;
+    } else if(last_timing==midi_quantizer_timing::late) {
+        px = color_t::red;
+    }
+    draw::filled_ellipse(lcd,rect16(point16(0,0),16),px);
+}
+static void draw_tempo_mult() {
     char sz[32];
     sprintf(sz, "x%0.2f", tempo_multiplier);
     open_text_info oti;
@@ -202,17 +904,46 @@ void update_tempo_mult() {
     ssize16 tsz = Telegrama_otf.measure_text(ssize16::max(), spoint16::zero(), oti.text, oti.scale);
     srect16 trc = tsz.bounds();
     trc.offset_inplace(lcd.dimensions().width - tsz.width - 2, 2);
-    draw::filled_rectangle(lcd, trc.inflate(100, 0), color_t::white);
+    // only clear what the old text covered
+    if (tempo_rect.y2 >= tempo_rect.y1 && tempo_rect.x1 < trc.x1) {
+        draw::filled_rectangle(lcd, srect16(tempo_rect.x1, tempo_rect.y1, trc.x1 - 1, tempo_rect.y2), color_t::white);
+    }
     draw::text(lcd, trc, oti, color_t::black, color_t::white);  
+    tempo_rect = trc;
 }
-void handle_midi(const uint8_t* data, size_t size, void* state) {
+// true if a region may still be drawn in the pass that began at frame_start
+static bool ui_in_budget(uint32_t frame_start, bool& force) {
+    if (force) {
+        force = false;
+        return true;
+    }
+    return micros() - frame_start < ui_budget;
+}
+// redraws whatever changed, checking the budget before each region.
+// anything left over is drawn on a later pass
+void render_ui(uint32_t frame_start) {
+    // a pass that had no time to draw lets the next one draw
+    // something regardless, so a busy loop() can't starve the screen
+    static bool starved = false;
+    bool force = starved;
+    bool drew = false;
+    if (timing_dirty && ui_in_budget(frame_start, force)) {
+        timing_dirty = false;
+        draw_timing();
+        drew = true;
+    }
+    if (tempo_dirty && ui_in_budget(frame_start, force)) {
+        tempo_dirty = false;
+        draw_tempo_mult();
+        drew = true;
+    }
+    starved = !drew && (timing_dirty || tempo_dirty);
+}
+void handle_message(const midi_message& msg, unsigned long long ago) {
     int base_note = base_octave * 12;
     bool note_on = false;
-    midi_message msg;
     int note;
     int vel;
-    const_buffer_stream cbs(data,size);
-    midi_stream::decode_message(false,cbs,&msg);
     if(msg.status) {
         switch (msg.type()) {
             case midi_message_type::note_on:
@@ -225,24 +956,16 @@ void handle_midi(const uint8_t* data, size_t size, void* state) {
                     note >= base_note && 
                     note < base_note + (int)sampler.tracks_count()) {
                     if (note_on && vel > 0) {
-                        quantizer.start(note - base_note);
+                        quantizer.start(note - base_note, ago);
                         last_timing = quantizer.last_timing();
                         last_timing_ts = millis()+1000;
-                        auto px = color_t::white;
-                        if(last_timing==midi_quantizer_timing::exact) {
-                            px = color_t::green;
-                        } else if(last_timing==midi_quantizer_timing::early) {
-                            px = color_t::blue;
-                        } else if(last_timing==midi_quantizer_timing::late) {
-                            px = color_t::red;
-                        }   
-                        draw::filled_ellipse(lcd,rect16(point16(0,0),16),px);
+                        timing_dirty = true;
                     } else {
                         quantizer.stop(note - base_note);
                     }
                 } else {
                     // just forward it
-                    midi_out.send(msg);
+                    scheduler.send(msg);
                 }
                 break;
             case midi_message_type::polyphonic_pressure:
@@ -261,15 +984,27 @@ void handle_midi(const uint8_t* data, size_t size, void* state) {
             case midi_message_type::stop_playback:
             case midi_message_type::tune_request:
             case midi_message_type::timing_clock:
-                midi_out.send(msg);
+                scheduler.send(msg);
                 break;
         }
     }
 }
+// everything but sysex comes in this way, stamped
+// with the cycle count from when it arrived
+void handle_midi_packet(uint32_t packet, uint32_t timestamp, void* state) {
+    midi_message msg;
+    if (midi_usb_packet_decode(packet, &msg) == sfx_result::success) {
+        uint32_t ago = (ARM_DWT_CYCCNT - timestamp) / (F_CPU_ACTUAL / 1000000);
+        handle_message(msg, ago);
+    }
+}
+void handle_midi(const uint8_t* data, size_t size, void* state) {
+    midi_message msg;
+    const_buffer_stream cbs(data,size);
+    midi_stream::decode_message(false,cbs,&msg);
+    handle_message(msg, 0);
+}
 void setup() {
-#ifdef HIGH_PRECISION
-    chrono_timer.begin(chrono_tick,1);
-#endif
     bool reset_on_boot = false;
     off_ts = 0;
     encoder_old_count = 0;
@@ -277,6 +1012,8 @@ void setup() {
     quantize_beats = 4;
     last_timing = midi_quantizer_timing::none;
     last_timing_ts = 0;
+    timing_dirty = false;
+    tempo_dirty = false;
     Serial.println("Prang booting");
     Serial.begin(115200);
     if(true!=lcd.initialize()) {
@@ -294,14 +1031,22 @@ void setup() {
     button_b.update();
     encoder.readAndReset();
     usb_host.begin();
+    midi_dev.setHandlePacket(handle_midi_packet,nullptr);
     midi_dev.setHandleMessage(handle_midi,nullptr);
     midi_out.initialize();
-    
-    sampler.output(&midi_out);
-
-    if(midi_quantizer::create(sampler,&quantizer)!=sfx_result::success) {
-        Serial.println("Unable to create quantizer");
-        while(true);
+    // everything released at once goes out together
+    midi_out.batching(true);
+#ifdef PRANG_DIAGNOSTICS
+    reported_lateness = 0;
+#endif
+    if (scheduler.begin(midi_out, precise_clock) == sfx_result::success) {
+        sampler.output(&scheduler, lookahead);
+    } else {
+        // without it nothing holds events until they're due,
+        // so send them as they're rendered and don't batch
+        Serial.println("Unable to start the scheduler");
+        midi_out.batching(false);
+        sampler.output(&midi_out);
     }
 
     if (button_a.pressed() || button_b.pressed()) {
@@ -351,94 +1096,64 @@ restart:
             has_settings = true;
         }
     }
+    // find every MIDI file on the card, then fill in what we know about them
+    boot_free(file_entries);
+    boot_free(file_names);
+    char path[max_path];
+    path[0] = 0;
     file = SD.open("/");
-    size_t fn_count = 0;
-    size_t fn_total = 0;
-    while (true) {
-        File f = file.openNextFile();
-        if (!f) {
-            break;
-        }
-        if (!f.isDirectory()) {
-            const char* fn = f.name();
-            size_t fnl = strlen(fn);
-            if ((fnl > 5 && ((0 == strcmp(".midi", fn + fnl - 5) ||
-                              (0 == strcmp(".MIDI", fn + fnl - 5) ||
-                               (0 == strcmp(".Midi", fn + fnl - 5)))))) ||
-                (fnl > 4 && ((0 == strcmp(".mid", fn + fnl - 4) ||
-                             0 == strcmp(".MID", fn + fnl - 4)) ||
-                 0 == strcmp(".Mid", fn + fnl - 4)))) {
-                ++fn_count;
-                fn_total += fnl + 1;
-            }
-        }
-        f.close();
+    bool collected = collect_files(file, path, 0);
+    file.close();
+    size_t fn_count = file_entries.size / sizeof(file_entry);
+    if (!collected) {
+        draw_error("too many files");
+        wait_and_restart();
     }
-    file.close();    
-    char* fns = (char*)malloc(fn_total + 1) + 1;
-    if(fn_total==0) {
+    if (fn_count == 0) {
         draw_error("no midi files");
         wait_and_restart();
     }
-    if (fns == nullptr) {
-        draw_error("too many files");
-        wait_and_restart();
+    file_entry* entries = (file_entry*)file_entries.data;
+    // anything the index doesn't know about gets scanned later
+    size_t old_index_size = 0;
+    uint8_t* old_index = load_index(&old_index_size);
+    uint32_t old_index_count = 0;
+    if (old_index != nullptr) {
+        memcpy(&old_index_count, old_index + 4, 4);
     }
-    midi_file_info* mfs = (midi_file_info*)malloc(fn_total * sizeof(midi_file_info));
-    if (mfs == nullptr) {
-        draw_error("too many files");
-        while (1)
-            ;
-    }
-    float loading_scale = Telegrama_otf.scale(15);
-    char loading_buf[64];
-    sprintf(loading_buf, "loading file 0 of %d", (int)fn_count);
-    ssize16 loading_size = Telegrama_otf.measure_text(ssize16::max(), spoint16::zero(), loading_buf, loading_scale);
-    srect16 loading_rect = loading_size.bounds().center_horizontal((srect16)lcd.bounds()).offset(0, lcd.dimensions().height - loading_size.height);
-    draw::text(lcd, loading_rect, spoint16::zero(), loading_buf, Telegrama_otf, loading_scale, color_t::blue, color_t::white, false);
-    file = SD.open("/");
-    char* str = fns;
-    int fi = 0;
-    int fli = 0;
-    while (true) {
-        File f = file.openNextFile();
-        if (!f) {
-            break;
-        }
-        if (!f.isDirectory()) {
-            const char* fn = f.name();
-            size_t fnl = strlen(fn);
-            if ((fnl > 5 && ((0 == strcmp(".midi", fn + fnl - 5) ||
-                              (0 == strcmp(".MIDI", fn + fnl - 5) ||
-                               (0 == strcmp(".Midi", fn + fnl - 5)))))) ||
-                (fnl > 4 && ((0 == strcmp(".mid", fn + fnl - 4) ||
-                             0 == strcmp(".MID", fn + fnl - 4)) ||
-                 0 == strcmp(".Mid", fn + fnl - 4)))) {
-                ++fli;
-                sprintf(loading_buf, "loading file %d of %d", fli, (int)fn_count);
-                draw::filled_rectangle(lcd, loading_rect, color_t::white);
-                loading_size = Telegrama_otf.measure_text(ssize16::max(), spoint16::zero(), loading_buf, loading_scale);
-                loading_rect = loading_size.bounds().center_horizontal((srect16)lcd.bounds()).offset(0, lcd.dimensions().height - loading_size.height);
-                draw::text(lcd, loading_rect, spoint16::zero(), loading_buf, Telegrama_otf, loading_scale, color_t::blue, color_t::white, false);
-                if (sfx_result::success == scan_file(f, &mfs[fi])) {
-                    memcpy(str, fn, fnl + 1);
-                    str += fnl + 1;
-                    ++fi;
-                } else {
-                    Serial.println("Failed to scan file");
-                    --fn_count;
-                }
+    size_t old_index_cursor = 0;
+    scan_pending_count = 0;
+    scan_failed_count = 0;
+    scan_next = 0;
+    for (size_t i = 0; i < fn_count; ++i) {
+        file_entry& e = entries[i];
+        const char* fn = file_name(e);
+        if (find_index(old_index, old_index_size, &old_index_cursor, fn, strlen(fn), e.size, e.mtime, &e.info)) {
+            e.scanned = true;
+            if (e.info.type < 0) {
+                ++scan_failed_count;
             }
+        } else {
+            ++scan_pending_count;
         }
-        f.close();
     }
-    file.close();
+    if (old_index != nullptr) {
+        free(old_index);
+    }
+    size_t scan_initial_count = scan_pending_count;
+    if (fn_count == 1 && !entries[0].scanned) {
+        scan_entry(entries[0]);
+    }
+    if (scan_failed_count == fn_count) {
+        draw_error("no midi files");
+        wait_and_restart();
+    }
+    sort_files(file_sort_by);
     draw::filled_rectangle(lcd, lcd.bounds(), color_t::white);
 
     base_octave = 4;
     tempo_multiplier = 1.0;
 
-    char* curfn = fns;
     size_t fni = 0;
     const open_font& fnt = PaulMaul;
     if (fn_count > 1) {
@@ -452,82 +1167,168 @@ restart:
         int64_t ocount = encoder.read();
         button_a.update();
         button_b.update();
-        int osw = button_a.pressed() || button_b.pressed();
-
+        bool osw_a = button_a.pressed();
+        bool osw_b = button_b.pressed();
+        if (entries[fni].scanned && entries[fni].info.type < 0) {
+            fni = step_file(fni, true);
+        }
         while (!done) {
+            const file_entry& e = entries[fni];
+            // drop the leading slash
+            const char* curfn = file_name(e) + 1;
             tsz = Telegrama_otf.measure_text(ssize16::max(), spoint16::zero(), curfn, fscale);
             trc = tsz.bounds().center_horizontal((srect16)lcd.bounds()).offset(0, 58);
             draw::filled_rectangle(lcd, srect16(0, trc.y1, lcd.dimensions().width - 1, trc.y2 + trc.height() + 5).inflate(100, 0), color_t::white);
             rgb_pixel<16> px = color_t::black;
-            if (mfs[fni].type == 1) {
+            if (e.info.type == 1) {
                 px = color_t::blue;
-            } else if (mfs[fni].type != 2) {
+            } else if (e.scanned && e.info.type != 2) {
                 px = color_t::red;
             }
             draw::text(lcd, trc, spoint16::zero(), curfn, Telegrama_otf, fscale, px, color_t::white, false);
             char szt[64];
-            sprintf(szt, "%d tracks", (int)mfs[fni].tracks);
+            if (!e.scanned) {
+                sprintf(szt, "scanning, by %s", file_sort_by == file_sort::tempo ? "tempo" : "name");
+            } else if (e.info.type < 0) {
+                strcpy(szt, "can't read file");
+            } else {
+                sprintf(szt, "%d tracks, by %s", (int)e.info.tracks, file_sort_by == file_sort::tempo ? "tempo" : "name");
+            }
             tsz = Telegrama_otf.measure_text(ssize16::max(), spoint16::zero(), szt, fscale);
             trc = tsz.bounds().center_horizontal((srect16)lcd.bounds()).offset(0, 73);
             draw::text(lcd, trc, spoint16::zero(), szt, Telegrama_otf, fscale, color_t::black, color_t::white, false);
-            int32_t mt = mfs[fni].microtempo;
-            if (mt == 0) {
-                strcpy(szt, "tempo: varies");
+            int32_t mt = e.info.microtempo;
+            if (e.scanned && e.info.type >= 0) {
+                if (mt == 0) {
+                    strcpy(szt, "tempo: varies");
+                } else {
+                    sprintf(szt, "tempo: %0.1f", midi_utility::microtempo_to_tempo(mt));
+                }
+                tsz = Telegrama_otf.measure_text(ssize16::max(), spoint16::zero(), szt, fscale);
+                trc = tsz.bounds().center_horizontal((srect16)lcd.bounds()).offset(0, 88);
+                draw::filled_rectangle(lcd, srect16(0, trc.y1, lcd.dimensions().width - 1, trc.y2 + trc.height() + 5).inflate(100, 0), color_t::white);
+                draw::text(lcd, trc, spoint16::zero(), szt, Telegrama_otf, fscale, color_t::black, color_t::white, false);
+                const midi_track_info* tis = (const midi_track_info*)track_infos.data + e.info.track_info;
+                int poly = 0;
+                for (int j = 0; j < e.info.tracks; ++j) {
+                    if (tis[j].polyphony > poly) {
+                        poly = tis[j].polyphony;
+                    }
+                }
+                uint32_t secs = (e.info.milliseconds + 500) / 1000;
+                sprintf(szt, "%d:%02d, %d notes, poly %d", (int)(secs / 60), (int)(secs % 60), (int)e.info.notes, poly);
+                tsz = Telegrama_otf.measure_text(ssize16::max(), spoint16::zero(), szt, fscale);
+                trc = tsz.bounds().center_horizontal((srect16)lcd.bounds()).offset(0, 103);
+                draw::text(lcd, trc, spoint16::zero(), szt, Telegrama_otf, fscale, color_t::black, color_t::white, false);
             } else {
-                sprintf(szt, "tempo: %0.1f", midi_utility::microtempo_to_tempo(mt));
+                draw::filled_rectangle(lcd, srect16(0, trc.y2 + 1, lcd.dimensions().width - 1, trc.y2 + trc.height() * 3 + 5).inflate(100, 0), color_t::white);
             }
-            tsz = Telegrama_otf.measure_text(ssize16::max(), spoint16::zero(), szt, fscale);
-            trc = tsz.bounds().center_horizontal((srect16)lcd.bounds()).offset(0, 88);
-            draw::filled_rectangle(lcd, srect16(0, trc.y1, lcd.dimensions().width - 1, trc.y2 + trc.height() + 5).inflate(100, 0), color_t::white);
-            draw::text(lcd, trc, spoint16::zero(), szt, Telegrama_otf, fscale, color_t::black, color_t::white, false);
             bool inc;
-            
+            bool resort = false;
+            bool refresh = false;
             while (ocount == (encoder.read()/4)) {
                 button_a.update();
                 button_b.update();
-                int sw = button_a.pressed() || button_b.pressed();
-                if (osw != sw && !sw) {
-                    // button was released
-                    done = true;
+                bool sw_a = button_a.pressed();
+                bool sw_b = button_b.pressed();
+                if (osw_a != sw_a && !sw_a) {
+                    // button a was released
+                    osw_a = sw_a;
+                    if (!entries[fni].scanned) {
+                        scan_entry(entries[fni]);
+                    }
+                    if (entries[fni].info.type >= 0) {
+                        done = true;
+                    } else {
+                        refresh = true;
+                    }
                     break;
                 }
-                osw = sw;
-                delay(1);
+                if (osw_b != sw_b && !sw_b) {
+                    // button b was released
+                    resort = true;
+                    osw_b = sw_b;
+                    break;
+                }
+                osw_a = sw_a;
+                osw_b = sw_b;
+                // scan a little in between polls
+                int scanned = scan_pending(fni);
+                if (scanned == (int)fni && entries[fni].scanned) {
+                    refresh = true;
+                    break;
+                }
+                if (scanned == -1) {
+                    delay(1);
+                }
             }
-            if (!done) {
+            if (scan_failed_count == fn_count) {
+                draw_error("no midi files");
+                wait_and_restart();
+            }
+            if (refresh) {
+                // don't leave the cursor on a file we can't read
+                if (entries[fni].info.type < 0) {
+                    size_t next = step_file(fni, true);
+                    fni = next != fni ? next : step_file(fni, false);
+                }
+            } else if (resort) {
+                // switch the order, staying on the same file
+                uint32_t name = entries[fni].name;
+                sort_files(file_sort_by == file_sort::name ? file_sort::tempo : file_sort::name);
+                for (size_t j = 0; j < fn_count; ++j) {
+                    if (entries[j].name == name) {
+                        fni = j;
+                        break;
+                    }
+                }
+            } else if (!done) {
                 int64_t count = (encoder.read()/4);
                 inc = (ocount < count);
                 ocount = count;
-                if (inc) {
-                    if (fni < fn_count - 1) {
-                        ++fni;
-                        curfn += strlen(curfn) + 1;
-                    }
-                } else {
-                    if (fni > 0) {
-                        --fni;
-                        curfn = fns;
-                        for (size_t j = 0; j < fni; ++j) {
-                            curfn += strlen(curfn) + 1;
-                        }
-                    }
-                }
+                fni = step_file(fni, inc);
             }
         }
     }
+    // drop whatever the browser was part way through scanning
+    if (scan.file) {
+        scan.file.close();
+    }
+    scanning = false;
     encoder_old_count = encoder.read() / 4;
+    const char* curfn = file_name(entries[fni]);
     Serial.print("File: ");
     Serial.println(curfn);
-    --curfn;
-    *curfn = '/';
     file = SD.open(curfn);
     if (!file) {
         draw_error("re-insert SD card");
         wait_and_restart();
     }
-    file_info = mfs[fni];
-    ::free(fns - 1);
-    ::free(mfs);
+    file_info = entries[fni].info;
+    // save what we know, in the order the card is walked
+    // so the next boot's lookups are sequential
+    qsort(entries, fn_count, sizeof(file_entry), file_compare_walk);
+    uint32_t index_count = 0;
+    boot_buffer index = {nullptr, 0, 0};
+    bool index_ok = nullptr != boot_reserve(index, index_header_size);
+    index.size = index_header_size;
+    for (size_t i = 0; index_ok && i < fn_count; ++i) {
+        const file_entry& e = entries[i];
+        if (e.scanned) {
+            const char* fn = file_name(e);
+            index_ok = put_index(index, fn, strlen(fn), e.size, e.mtime, e.info);
+            ++index_count;
+        }
+    }
+    if (index_ok && (scan_pending_count != scan_initial_count || index_count != old_index_count)) {
+        memcpy(index.data, &index_magic, 4);
+        memcpy(index.data + 4, &index_count, 4);
+        save_index(index.data, index.size);
+    }
+    boot_free(index);
+    boot_free(file_entries);
+    boot_free(file_names);
+    boot_free(track_infos);
     draw::filled_rectangle(lcd, lcd.bounds(), color_t::white);
     if (!has_settings) {
         static const char* oct_text = "base oct4vE";
@@ -681,8 +1482,23 @@ restart:
         }
     }
 
+    // let go of the last song before its memory is reused
+    quantizer = midi_quantizer();
+    sampler = midi_sampler();
+    song_arena.reset();
     file_stream fs(file);
-    sfx_result r = midi_sampler::read(fs, &sampler);
+    // the raw file is only needed while loading, so read it
+    // into PSRAM if there is any. this falls back to the heap
+    sfx_result r = midi_sampler::read(fs, &sampler, arena_allocate<song_arena>, arena_deallocate<song_arena>, extmem_malloc, extmem_free);
+    if (r == sfx_result::out_of_memory) {
+        // stream it from the SD card instead
+        if (song_stream != nullptr) {
+            delete song_stream;
+        }
+        song_stream = new file_stream(file);
+        song_arena.reset();
+        r = midi_sampler::open(*song_stream, &sampler, 64, arena_allocate<song_arena>, arena_deallocate<song_arena>);
+    }
     if (r != sfx_result::success) {
         switch (r) {
             case sfx_result::out_of_memory:
@@ -697,23 +1513,35 @@ restart:
                 goto restart;
         }
     }
-    file.close();
+    if (!sampler.streaming()) {
+        file.close();
+    }
     const char* playing_text = "pLay1nG";
     float playing_scale = fnt.scale(100);
     ssize16 playing_size = fnt.measure_text(ssize16::max(), spoint16::zero(), playing_text, playing_scale);
     draw::filled_rectangle(lcd, lcd.bounds(), color_t::white);
     draw::text(lcd, playing_size.bounds().center((srect16)lcd.bounds()), spoint16::zero(), playing_text, fnt, playing_scale, color_t::red, color_t::white, false);
+    // the screen was just cleared, so nothing to erase
+    tempo_rect = srect16(0, 0, -1, -1);
     update_tempo_mult();
-    r = midi_quantizer::create(sampler, &quantizer);
+    r = midi_quantizer::create(sampler, &quantizer, arena_allocate<song_arena>, arena_deallocate<song_arena>);
     if (r != sfx_result::success) {
         draw_error("file too big");
         delay(3000);
         goto restart;
     }
+#ifdef PRANG_DIAGNOSTICS
+    Serial.printf("Song memory: %d of %d bytes, peak %d\n", (int)song_arena.used(), (int)song_arena.capacity(), (int)song_arena.peak());
+#endif
     quantizer.quantize_beats(quantize_beats);
     sampler.tempo_multiplier(tempo_multiplier);
-    sampler.output(&midi_out);
-    for (size_t i = 0; i < sampler.tracks_count(); ++i) {
+    if (scheduler.running()) {
+        sampler.output(&scheduler, lookahead);
+    } else {
+        sampler.output(&midi_out);
+    }
+    sampler.clock(&precise_clock);
+    for (size_t i = sampler.next_started(0); i < sampler.tracks_count(); i = sampler.next_started(i + 1)) {
         sampler.stop(i);
     }
     encoder_old_count = encoder.read() / 4;
@@ -722,6 +1550,11 @@ restart:
 }
 
 void loop() {
+    uint32_t frame_start = micros();
+    // input first, since the LCD can hold up the rest.
+    // drain everything waiting, within the budget
+    usb_host.Task();
+    midi_dev.readAll(input_budget);
     int64_t enc = encoder.read() / 4;
     if(encoder_old_count!=enc) {
         bool inc = encoder_old_count < enc;
@@ -738,45 +1571,30 @@ void loop() {
             }
         }
     }
-    usb_host.Task();
-    midi_dev.read();
     sampler.update();
+#ifdef PRANG_DIAGNOSTICS
+    if (scheduler.max_lateness() > reported_lateness) {
+        reported_lateness = scheduler.max_lateness();
+        Serial.printf("Worst lateness: %dus, average %dus\n", (int)reported_lateness, (int)scheduler.average_lateness());
+    }
+#endif
     if(last_timing_ts && millis()>=last_timing_ts) {
         last_timing_ts = 0;
-        draw::filled_ellipse(lcd,rect16(point16(0,0),16),color_t::white);
+        last_timing = midi_quantizer_timing::none;
+        timing_dirty = true;
+    }
+    render_ui(frame_start);
+    // send whatever this pass batched. while the scheduler runs,
+    // midi_out belongs to its interrupt, which flushes after sending
+    if (!scheduler.running()) {
+        midi_out.flush();
     }
-    
 }
-// implement _gettimeofday so std::chrono (used by SFX) works
-#ifdef HIGH_PRECISION
-extern "C" {
-  int _gettimeofday( struct timeval *tv, void *tzvp )
-  {
-    // uptime in microseconds
-    uint64_t t;
-    noInterrupts();
-    t=chrono_tick_count;
-    interrupts();
-    tv->tv_sec = t / 1000000;  // convert to seconds
-    tv->tv_usec = ( t % 1000000 ) ;  // get remaining microseconds
-    return 0;  // return non-zero for error
-  } // end _gettimeofday()
-}
-#else
+// implement _gettimeofday so std::chrono (used by SFX) works.
+// it's uptime rather than wall clock time
 extern "C" int _gettimeofday(struct timeval *tv, void *ignore) {
-  uint32_t hi1 = SNVS_HPRTCMR;
-  uint32_t lo1 = SNVS_HPRTCLR;
-  while (1) {
-    uint32_t hi2 = SNVS_HPRTCMR;  // ref manual 20.3.3.1.3 page 1231
-    uint32_t lo2 = SNVS_HPRTCLR;
-    if (lo1 == lo2 && hi1 == hi2) {
-        
-      tv->tv_sec = (hi2 << 17) | (lo2 >> 15);
-      tv->tv_usec = ((lo2 & 0x7FFF) * 15625) >> 9;
-      return 0;
-    }
-    hi1 = hi2;
-    lo1 = lo2;
-  }
-}
-#endif
\ No newline at end of file
+    unsigned long long t = precise_clock.now();
+    tv->tv_sec = t / 1000000;
+    tv->tv_usec = t % 1000000;
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#include "memory_arena.hpp"
+// enough for anything stored in the arena
+constexpr static const size_t arena_alignment = 8;
+memory_arena::memory_arena(void* buffer,size_t capacity) : m_begin((uint8_t*)buffer),
+        m_capacity(capacity),
+        m_used(0),
+        m_peak(0),
+        m_last(0) {
+    // start aligned, so every offset we hand out is aligned too
+    size_t skip = (arena_alignment-(uintptr_t)m_begin%arena_alignment)%arena_alignment;
+    if(skip>m_capacity) {
+        skip = m_capacity;
+    }
+    m_begin+=skip;
+    m_capacity-=skip;
+}
+void* memory_arena::allocate(size_t size) {
+    size_t aligned = (size+arena_alignment-1)&~(arena_alignment-1);
+    if(aligned<size || aligned>m_capacity-m_used) {
+        return nullptr;
+    }
+    m_last = m_used;
+    m_used+=aligned;
+    if(m_used>m_peak) {
+        m_peak = m_used;
+    }
+    return m_begin+m_last;
+}
+void memory_arena::deallocate(void* ptr) {
+    // anything but the last allocation waits for reset()
+    if(ptr!=nullptr && ptr==m_begin+m_last && m_last<m_used) {
+        m_used = m_last;
+    }
+}
+void memory_arena::reset() {
+    m_used = 0;
+    m_last = 0;
+}
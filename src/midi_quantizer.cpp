@@ -5,6 +5,7 @@ midi_quantizer::midi_quantizer(midi_quantizer&& rhs) {
     rhs.m_sampler = nullptr;
     m_deallocator = rhs.m_deallocator;
     rhs.m_deallocator = nullptr;
+    m_quantize_beats = rhs.m_quantize_beats;
     m_follow_key = rhs.m_follow_key;
     m_last_key_ticks= rhs.m_last_key_ticks;
     m_last_timing = rhs.m_last_timing;
@@ -17,6 +18,7 @@ midi_quantizer& midi_quantizer::operator=(midi_quantizer&& rhs) {
     rhs.m_sampler = nullptr;
     m_deallocator = rhs.m_deallocator;
     rhs.m_deallocator = nullptr;
+    m_quantize_beats = rhs.m_quantize_beats;
     m_follow_key = rhs.m_follow_key;
     m_last_key_ticks= rhs.m_last_key_ticks;
     m_last_timing = rhs.m_last_timing;
@@ -33,17 +35,23 @@ void midi_quantizer::deallocate() {
     }
 }
 sfx_result midi_quantizer::create(midi_sampler& sampler,midi_quantizer* out_quantizer, void*(*allocator)(size_t),void(*deallocator)(void*)) {
-    out_quantizer->m_sampler = &sampler;
-    out_quantizer->m_deallocator = deallocator;
-    out_quantizer->m_quantize_beats = 4;
-    out_quantizer->m_follow_key = -1;
-    out_quantizer->m_last_key_ticks = 0;
-    out_quantizer->m_last_timing = midi_quantizer_timing::none;
-    out_quantizer->m_key_advance = (long*)allocator(sizeof(long)*sampler.tracks_count());
-    if(out_quantizer->m_key_advance==nullptr) {
+    if(out_quantizer==nullptr||allocator==nullptr||deallocator==nullptr) {
+        return sfx_result::invalid_argument;
+    }
+    midi_quantizer result;
+    result.m_sampler = &sampler;
+    result.m_deallocator = deallocator;
+    result.m_quantize_beats = 4;
+    result.m_follow_key = -1;
+    result.m_last_key_ticks = 0;
+    result.m_last_timing = midi_quantizer_timing::none;
+    result.m_key_advance = (long*)allocator(sizeof(long)*sampler.tracks_count());
+    if(result.m_key_advance==nullptr) {
         return sfx_result::out_of_memory;
     }
-    memset(out_quantizer->m_key_advance,0,sizeof(long)*sampler.tracks_count());
+    memset(result.m_key_advance,0,sizeof(long)*sampler.tracks_count());
+    // frees whatever out_quantizer held before
+    *out_quantizer = (midi_quantizer&&)result;
     return sfx_result::success;
 }
 void midi_quantizer::quantize_beats(int value) {
@@ -52,13 +60,13 @@ void midi_quantizer::quantize_beats(int value) {
     }
     m_quantize_beats = value;
 }
-sfx_result midi_quantizer::start(size_t index) {
+sfx_result midi_quantizer::start(size_t index,unsigned long long ago) {
     if(m_sampler==nullptr || 
             index<0||
             index>=m_sampler->tracks_count()) {
         return sfx_result::invalid_argument;
     }
-    m_last_key_ticks = m_sampler->elapsed(index);
+    m_last_key_ticks = m_sampler->elapsed(index,ago);
     if(!m_quantize_beats || m_follow_key==-1) {
         m_sampler->start(index);
         m_key_advance[index]=0;
@@ -70,7 +78,10 @@ sfx_result midi_quantizer::start(size_t index) {
     unsigned long long adv=0;
     int tb = m_sampler->timebase(m_follow_key) 
                 * m_quantize_beats;
-    smp_elapsed=m_sampler->elapsed(m_follow_key)
+    // judge the timing by when the key actually arrived
+    unsigned long long arrived = m_sampler->elapsed(m_follow_key,ago);
+    unsigned long long now = m_sampler->elapsed(m_follow_key,0);
+    smp_elapsed=arrived
                 - m_key_advance[m_follow_key];
     adv= smp_elapsed % tb;
     unsigned long long adv2=adv-tb;
@@ -82,6 +93,10 @@ sfx_result midi_quantizer::start(size_t index) {
     } else {
         m_last_timing = midi_quantizer_timing::exact;
     }
+    // but line it up with where the follow key is now
+    if(now>arrived) {
+        adv+=now-arrived;
+    }
     sfx_result r = m_sampler->start(index,adv);
     if(r!=sfx_result::success) {
         return r;
@@ -100,13 +115,8 @@ sfx_result midi_quantizer::stop(size_t index) {
         return r;
     }
     if(m_follow_key==(int)index) {
-        m_follow_key = -1;
-        for(size_t i = 0;i<m_sampler->tracks_count();++i) {
-            if(m_sampler->started(i)) {
-                m_follow_key = i;
-                break;
-            }
-        }
+        size_t i = m_sampler->next_started(0);
+        m_follow_key = i<m_sampler->tracks_count()?(int)i:-1;
     }
     return sfx_result::success;
 }
\ No newline at end of file
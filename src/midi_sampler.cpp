@@ -1,63 +1,628 @@
 #include "midi_sampler.hpp"
-#include <sfx_midi_stream.hpp>
+#include <new>
+#include <chrono>
 #include <sfx_midi_file.hpp>
 using namespace sfx;
-void midi_sampler::callback(uint32_t pending,
-        unsigned long long elapsed, 
-        void* pstate) {
-    track *t = (track*)pstate;
-    if(t->delay>elapsed) {
-        //Serial.print(".");
-        return;
-    } else if(t->delay) {
-        t->clock.elapsed(elapsed-t->delay);
-        t->delay=0;
-    }
-    while(t->event.absolute<=elapsed) {
-        if (t->event.message.type() ==
-                midi_message_type::meta_event) {
-            // if it's a tempo event update the clock tempo
-            if(t->event.message.meta.type == 0x51) {
-                int32_t mt = (t->event.message.meta.data[0] << 16) | 
-                    (t->event.message.meta.data[1] << 8) | 
-                    t->event.message.meta.data[2];
-                // update the clock microtempo
-                t->base_microtempo = mt;
-                t->clock.microtempo(mt/t->tempo_multiplier);
+// reads a variable length quantity, adding the bytes it took to count
+static bool read_varlen(stream& in,uint32_t* out_value,size_t* in_out_count) {
+    uint32_t value = 0;
+    for(int i = 0;i<4;++i) {
+        int b = in.getch();
+        if(b<0) {
+            return false;
+        }
+        ++*in_out_count;
+        value = (value<<7)|(b&0x7F);
+        if(0==(b&0x80)) {
+            *out_value = value;
+            return true;
+        }
+    }
+    return false;
+}
+static size_t data_bytes(uint8_t status) {
+    switch(status&0xF0) {
+        case 0xC0:
+        case 0xD0:
+            return 1;
+        case 0xF0:
+            if(status==0xF1 || status==0xF3) {
+                return 1;
             }
+            return status==0xF2?2:0;
+        default:
+            return 2;
+    }
+}
+// rounds a byte count up so whatever follows it stays aligned
+static size_t padded(size_t size) {
+    return (size+3)&~size_t(3);
+}
+void midi_sampler::decode_window(stream& in,size_t size,cursor& cur,window& w,size_t capacity,size_t sysex_capacity,size_t sysex_data_capacity) {
+    // in holds size bytes of the track starting at cur.
+    // if w has no arrays the events are only counted.
+    // events are decoded here rather than by midi_stream so
+    // that meta and sysex data never go through the heap
+    size_t pos = 0;
+    while(pos<size && w.size<capacity) {
+        // stopping partway through an event leaves the cursor
+        // before it, whether it's truncated, corrupt, or there's
+        // no room left for its sysex data
+        size_t sz = 0;
+        uint32_t delta;
+        if(!read_varlen(in,&delta,&sz)) {
+            break;
+        }
+        int b = in.getch();
+        if(b<0) {
+            break;
         }
-        else if(t->event.message.status!=0) {    
-            t->tracker.process(t->event.message);
-            if(t->output!=nullptr) {
-                t->output->send(t->event.message);
+        ++sz;
+        bool running = b<0x80;
+        uint8_t status = running?cur.status:uint8_t(b);
+        if(status<0x80) {
+            break;
+        }
+        uint32_t event = status;
+        uint32_t length = 0;
+        bool keep = false;
+        bool end = false;
+        if(status==0xFF) {
+            int type = in.getch();
+            if(type<0) {
+                break;
+            }
+            ++sz;
+            if(!read_varlen(in,&length,&sz) || pos+sz+length>size) {
+                break;
+            }
+            end = type==0x2F;
+            if(type==0x51 && length==3) {
+                // we only care about tempo changes, and a tempo that
+                // isn't 3 bytes long is malformed so it's skipped
+                uint8_t mt[3];
+                if(3!=in.read(mt,3)) {
+                    break;
+                }
+                event|=((uint32_t(mt[0])<<16)|(uint32_t(mt[1])<<8)|mt[2])<<8;
+                keep = true;
+            } else if(length!=0) {
+                in.seek(length,seek_origin::current);
+            }
+            sz+=length;
+        } else if(status==0xF0 || status==0xF7) {
+            if(!read_varlen(in,&length,&sz) || pos+sz+length>size ||
+                    w.sysex_data_size+length>sysex_data_capacity) {
+                break;
+            }
+            if(w.sysex_data!=nullptr) {
+                if(length!=in.read(w.sysex_data+w.sysex_data_size,length)) {
+                    break;
+                }
+            } else if(length!=0) {
+                in.seek(length,seek_origin::current);
+            }
+            sz+=length;
+            event|=uint32_t(w.sysex_size)<<8;
+            keep = true;
+        } else {
+            size_t count = data_bytes(status);
+            size_t i = 0;
+            for(;i<count;++i) {
+                int d = b;
+                if(i>0 || !running) {
+                    d = in.getch();
+                    if(d<0) {
+                        break;
+                    }
+                    ++sz;
+                }
+                event|=uint32_t(uint8_t(d))<<(8*(i+1));
+            }
+            if(i<count) {
+                break;
             }
+            // system common messages don't belong in a file
+            keep = status<0xF0;
+        }
+        if(pos+sz>size) {
+            break;
+        }
+        pos+=sz;
+        cur.offset+=sz;
+        cur.tick+=delta;
+        if(status<0xF0) {
+            cur.status = status;
         }
-        bool restarted = false;
-        if(t->buffer_position>=t->buffer_size) {
-            t->buffer_position = 0;
-            t->event.absolute = 0;
-            t->event.delta = 0;
-            t->event.message.~midi_message();
-            t->event.message.status=0;
-            t->clock.stop();
-            t->clock.microtempo(t->base_microtempo/t->tempo_multiplier);
-            t->clock.start();
-            restarted = true;
-            if(t->output!=nullptr) {
-                t->tracker.send_off(*t->output);
+        if(end) {
+            // end of track
+            w.final = true;
+            break;
+        }
+        if(keep) {
+            bool sysex = status==0xF0 || status==0xF7;
+            if(w.ticks!=nullptr) {
+                w.ticks[w.size]=cur.tick;
+                w.events[w.size]=event;
+                if(sysex) {
+                    sysex_span& span = w.sysex[w.sysex_size];
+                    span.offset = (uint32_t)w.sysex_data_size;
+                    span.size = length;
+                    span.status = status;
+                }
+            }
+            ++w.size;
+            if(sysex) {
+                w.sysex_data_size+=length;
+                if(++w.sysex_size>=sysex_capacity) {
+                    break;
+                }
             }
         }
-
-        const_buffer_stream cbs(t->buffer,t->buffer_size);
-        cbs.seek(t->buffer_position);
-        size_t sz = midi_stream::decode_event(true,cbs,&t->event);
-        t->buffer_position+=sz;
-        if(sz==0) {
-            t->clock.stop();
-        }
-        if(restarted) {
+    }
+    w.end = cur;
+}
+void midi_sampler::init_track(track& t) {
+    new(&t) track();
+    window* windows[] = {&t.head,&t.ring[0],&t.ring[1]};
+    for(window* w : windows) {
+        w->ticks = nullptr;
+        w->events = nullptr;
+        w->sysex = nullptr;
+        w->sysex_data = nullptr;
+        w->size = 0;
+        w->sysex_size = 0;
+        w->sysex_data_size = 0;
+        w->begin = npos;
+        w->end.offset = 0;
+        w->end.tick = 0;
+        w->end.status = 0;
+        w->final = false;
+    }
+    t.current = &t.head;
+    t.position = 0;
+    t.length = 0;
+    t.offset = 0;
+    t.size = 0;
+    t.checkpoints = nullptr;
+    t.checkpoints_size = 0;
+    t.chase = nullptr;
+    t.chase_sysex = nullptr;
+    t.chase_sysex_data = nullptr;
+    t.anchor_time = 0;
+    t.anchor_offset = 0;
+    t.looped = false;
+    t.start_time = 0;
+    t.due = 0;
+    t.heap_index = npos;
+}
+void midi_sampler::count_track(const uint8_t* buffer,size_t size,track& t) {
+    // leaves the event, sysex and sysex byte counts in the head window
+    window& w = t.head;
+    const_buffer_stream cbs(buffer,size);
+    cursor cur = {0,0,0};
+    decode_window(cbs,size,cur,w,npos,npos,npos);
+    // the fill stops at the last event, so take the end of track from here
+    t.length = cur.tick;
+}
+uint8_t* midi_sampler::decode_track(const uint8_t* buffer,size_t size,track& t,uint8_t* storage) {
+    // storage has room for what count_track() found
+    window& w = t.head;
+    size_t events_size = w.size;
+    size_t sysex_size = w.sysex_size;
+    size_t sysex_data_size = w.sysex_data_size;
+    w.size = 0;
+    w.sysex_size = 0;
+    w.sysex_data_size = 0;
+    if(events_size!=0) {
+        w.sysex = (sysex_span*)storage;
+        w.ticks = (uint32_t*)(w.sysex+sysex_size);
+        w.events = w.ticks+events_size;
+        w.sysex_data = (uint8_t*)(w.events+events_size);
+        storage = w.sysex_data+padded(sysex_data_size);
+        const_buffer_stream cbs(buffer,size);
+        cursor cur = {0,0,0};
+        decode_window(cbs,size,cur,w,events_size,npos,npos);
+    }
+    // the head holds every sysex message, so it's chased from there
+    t.chase_sysex = w.sysex;
+    t.chase_sysex_data = w.sysex_data;
+    w.begin = 0;
+    w.final = true;
+    return storage;
+}
+void midi_sampler::free_track(track& t) {
+    t.~track();
+}
+unsigned long long midi_sampler::clock_now() const {
+    if(m_clock!=nullptr) {
+        return m_clock->now();
+    }
+    using namespace std::chrono;
+    return (unsigned long long)duration_cast<microseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+void midi_sampler::advance_transport() {
+    unsigned long long now = clock_now();
+    unsigned long long scaled = (now-m_clock_last)*m_tempo_multiplier+m_clock_fraction;
+    m_clock_last = now;
+    m_now += scaled>>16;
+    m_clock_fraction = uint32_t(scaled&0xFFFF);
+}
+unsigned long long midi_sampler::transport_now() const {
+    // where advance_transport() would put m_now, without moving it
+    unsigned long long scaled = (clock_now()-m_clock_last)*m_tempo_multiplier+m_clock_fraction;
+    return m_now+(scaled>>16);
+}
+unsigned long long midi_sampler::tick_time(uint32_t tick) const {
+    // the last segment at or before tick
+    size_t lo = 1;
+    size_t hi = m_tempo_map_size;
+    while(lo<hi) {
+        size_t mid = lo+(hi-lo)/2;
+        if(m_tempo_map[mid].tick<=tick) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+    const tempo_segment& seg = m_tempo_map[lo-1];
+    return seg.time+
+        (unsigned long long)(tick-seg.tick)*seg.microtempo/m_timebase;
+}
+uint32_t midi_sampler::time_tick(unsigned long long time) const {
+    size_t lo = 1;
+    size_t hi = m_tempo_map_size;
+    while(lo<hi) {
+        size_t mid = lo+(hi-lo)/2;
+        if(m_tempo_map[mid].time<=time) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+    const tempo_segment& seg = m_tempo_map[lo-1];
+    return seg.tick+
+        (uint32_t)((time-seg.time)*m_timebase/seg.microtempo);
+}
+unsigned long long midi_sampler::time_of(const track& t,uint32_t tick) const {
+    return t.anchor_time+tick_time(tick)-t.anchor_offset;
+}
+unsigned long long midi_sampler::next_due(const track& t) const {
+    const window& w = *t.current;
+    if(t.position<w.size) {
+        return time_of(t,w.ticks[t.position]);
+    }
+    if(!w.final) {
+        // play() moves to the next window
+        return m_now;
+    }
+    return time_of(t,t.length);
+}
+unsigned long long midi_sampler::clock_time(unsigned long long time) const {
+    // m_clock_last is the clock reading at m_now
+    if(time<=m_now) {
+        return m_clock_last;
+    }
+    return m_clock_last+((time-m_now)<<16)/m_tempo_multiplier;
+}
+midi_output* midi_sampler::sink(track& t,unsigned long long time) {
+    if(m_timed==nullptr) {
+        return m_output;
+    }
+    // everything sent through the sink is held until time
+    m_sink.output = m_timed;
+    m_sink.due = clock_time(time);
+    m_sink.tag = size_t(&t-m_tracks);
+    return &m_sink;
+}
+midi_sampler::window* midi_sampler::successor(track& t,const window& w) {
+    // a window is reusable if it starts where w leaves
+    // off, even if it's left over from the last loop
+    for(size_t i = 0;i<2;++i) {
+        window& r = t.ring[i];
+        if(&r!=&w && r.begin==w.end.offset) {
+            return &r;
+        }
+    }
+    return nullptr;
+}
+sfx_result midi_sampler::fill(track& t,window& w,const cursor& from) {
+    w.size = 0;
+    w.sysex_size = 0;
+    w.sysex_data_size = 0;
+    w.final = false;
+    w.begin = npos;
+    cursor cur = from;
+    size_t remaining = t.size-cur.offset;
+    if(remaining>0) {
+        size_t len = remaining<scratch_size?remaining:scratch_size;
+        unsigned long long pos = t.offset+cur.offset;
+        if(pos!=m_stream->seek(pos) || len!=m_stream->read(m_scratch,len)) {
+            return sfx_result::io_error;
+        }
+        // read in one block and decode from memory
+        const_buffer_stream cbs(m_scratch,len);
+        decode_window(cbs,len,cur,w,m_window_size,sysex_window_size,sysex_data_window_size);
+        if(cur.offset==from.offset && !w.final) {
+            // a single event larger than the scratch
+            // buffer so decode it from the stream itself
+            m_stream->seek(pos);
+            decode_window(*m_stream,remaining,cur,w,1,sysex_window_size,sysex_data_window_size);
+            if(cur.offset==from.offset && !w.final) {
+                // count it again with no limit on the sysex
+                // data to tell a sysex too long to hold from
+                // a corrupt event
+                window probe;
+                probe.ticks = nullptr;
+                probe.sysex_data = nullptr;
+                probe.size = 0;
+                probe.sysex_size = 0;
+                probe.sysex_data_size = 0;
+                probe.final = false;
+                cursor c = from;
+                m_stream->seek(pos);
+                decode_window(*m_stream,remaining,c,probe,1,1,npos);
+                if(c.offset!=from.offset) {
+                    return sfx_result::not_supported;
+                }
+                // corrupt, so end the track here
+                w.final = true;
+            }
+        }
+    }
+    if(cur.offset>=t.size) {
+        w.final = true;
+    }
+    w.begin = from.offset;
+    w.end = cur;
+    if(w.final) {
+        t.length = cur.tick;
+    }
+    return sfx_result::success;
+}
+sfx_result midi_sampler::index_track(track& t,uint32_t* work,size_t* out_checkpoints_size,size_t* out_chase_size,size_t* out_sysex_size,size_t* out_sysex_data_size,size_t* out_tempo_size) {
+    // walks the whole track keeping what a start partway in
+    // would need to chase. if there's no index yet it only counts
+    const uint32_t interval = (uint32_t)m_timebase*checkpoint_beats;
+    size_t checkpoints_size = 0;
+    size_t chase_size = 0;
+    size_t sysex_size = 0;
+    size_t sysex_data_size = 0;
+    size_t tempo_size = 0;
+    size_t work_size = 0;
+    uint32_t snapshot_begin = 0;
+    uint32_t snapshot_size = 0;
+    bool dirty = false;
+    uint32_t next_tick = 0;
+    window* w = &t.head;
+    cursor start = {0,0,0};
+    while(true) {
+        for(size_t i = 0;i<w->size;++i) {
+            uint32_t tick = w->ticks[i];
+            uint32_t e = w->events[i];
+            // when streaming we can only resume at the start of a window
+            if(tick>=next_tick && (m_stream==nullptr || i==0)) {
+                if(dirty) {
+                    // checkpoints share the snapshot until it changes
+                    if(t.chase!=nullptr) {
+                        memcpy(t.chase+chase_size,work,work_size*sizeof(uint32_t));
+                    }
+                    snapshot_begin = (uint32_t)chase_size;
+                    snapshot_size = (uint32_t)work_size;
+                    chase_size+=work_size;
+                    dirty = false;
+                }
+                if(t.checkpoints!=nullptr) {
+                    checkpoint& cp = t.checkpoints[checkpoints_size];
+                    cp.tick = tick;
+                    cp.position = (uint32_t)i;
+                    cp.at = start;
+                    cp.chase_begin = snapshot_begin;
+                    cp.chase_size = snapshot_size;
+                    cp.sysex_count = (uint32_t)sysex_size;
+                }
+                ++checkpoints_size;
+                next_tick = (tick/interval+1)*interval;
+            }
+            uint8_t status = uint8_t(e);
+            if(status==0xFF) {
+                if(int32_t(e>>8)>0) {
+                    if(t.checkpoints!=nullptr) {
+                        tempo_segment& seg = m_tempo_map[m_tempo_map_size++];
+                        seg.tick = tick;
+                        seg.microtempo = int32_t(e>>8);
+                        seg.time = 0;
+                    }
+                    ++tempo_size;
+                }
+            } else if(status==0xF0 || status==0xF7) {
+                // when streaming the bytes are copied out, since
+                // the window won't still hold them when they're chased
+                const sysex_span& span = w->sysex[e>>8];
+                if(m_stream!=nullptr && t.checkpoints!=nullptr) {
+                    sysex_span& chased = t.chase_sysex[sysex_size];
+                    chased.offset = (uint32_t)sysex_data_size;
+                    chased.size = span.size;
+                    chased.status = span.status;
+                    memcpy(t.chase_sysex_data+sysex_data_size,w->sysex_data+span.offset,span.size);
+                }
+                ++sysex_size;
+                sysex_data_size+=span.size;
+            } else if(is_chased(e)) {
+                // the latest value replaces any earlier one for the
+                // same controller or patch, keeping the list in the
+                // order they were last sent
+                uint32_t key = (status&0xF0)==0xB0?0xFFFF:0xFF;
+                size_t j = 0;
+                while(j<work_size && (work[j]&key)!=(e&key)) {
+                    ++j;
+                }
+                if(j<work_size) {
+                    memmove(work+j,work+j+1,(work_size-j-1)*sizeof(uint32_t));
+                    --work_size;
+                }
+                work[work_size++] = e;
+                dirty = true;
+            }
+        }
+        if(w->final) {
             break;
         }
+        start = w->end;
+        w = &t.ring[0];
+        sfx_result res = fill(t,*w,start);
+        if(res!=sfx_result::success) {
+            return res;
+        }
+    }
+    *out_checkpoints_size = checkpoints_size;
+    *out_chase_size = chase_size;
+    *out_sysex_size = sysex_size;
+    *out_sysex_data_size = sysex_data_size;
+    *out_tempo_size = tempo_size;
+    return sfx_result::success;
+}
+void midi_sampler::build_tempo_map() {
+    // the first segment is the default tempo, and the rest
+    // were gathered track by track so sort them by tick.
+    // there are only ever a few so insertion sort is fine
+    for(size_t i = 2;i<m_tempo_map_size;++i) {
+        tempo_segment seg = m_tempo_map[i];
+        size_t j = i;
+        while(j>1 && m_tempo_map[j-1].tick>seg.tick) {
+            m_tempo_map[j] = m_tempo_map[j-1];
+            --j;
+        }
+        m_tempo_map[j] = seg;
+    }
+    // the last change at any one tick wins
+    size_t size = 0;
+    for(size_t i = 0;i<m_tempo_map_size;++i) {
+        if(size>0 && m_tempo_map[size-1].tick==m_tempo_map[i].tick) {
+            --size;
+        }
+        m_tempo_map[size++] = m_tempo_map[i];
+    }
+    m_tempo_map_size = size;
+    // precompute where each segment starts
+    m_tempo_map[0].time = 0;
+    for(size_t i = 1;i<m_tempo_map_size;++i) {
+        const tempo_segment& prev = m_tempo_map[i-1];
+        m_tempo_map[i].time = prev.time+
+            (unsigned long long)(m_tempo_map[i].tick-prev.tick)*prev.microtempo/m_timebase;
+    }
+}
+const midi_sampler::checkpoint* midi_sampler::find_checkpoint(const track& t,uint32_t tick) const {
+    // the last checkpoint at or before tick
+    size_t lo = 0;
+    size_t hi = t.checkpoints_size;
+    while(lo<hi) {
+        size_t mid = lo+(hi-lo)/2;
+        if(t.checkpoints[mid].tick<=tick) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo==0?nullptr:&t.checkpoints[lo-1];
+}
+sfx_result midi_sampler::next_window(track& t) {
+    // move on now, reading the window in if refill() hasn't
+    window* next = successor(t,*t.current);
+    if(next==nullptr) {
+        next = t.current==&t.ring[0]?&t.ring[1]:&t.ring[0];
+        sfx_result res = fill(t,*next,t.current->end);
+        if(res!=sfx_result::success) {
+            return res;
+        }
+    }
+    t.current = next;
+    t.position = 0;
+    return sfx_result::success;
+}
+void midi_sampler::refill() {
+    // refill the one track that will run dry the soonest
+    track* next = nullptr;
+    const window* next_from = nullptr;
+    unsigned long long next_time = 0;
+    for(size_t i = 0;i<m_heap_size;++i) {
+        track& t = m_tracks[m_heap[i]];
+        const window* w = t.current;
+        unsigned long long time;
+        if(w->final) {
+            // the loop goes back through the head, so
+            // what's needed next is whatever follows it
+            w = &t.head;
+            time = time_of(t,t.length);
+        } else {
+            time = w->size?time_of(t,w->ticks[w->size-1]):0;
+        }
+        if(w->final || successor(t,*w)!=nullptr) {
+            continue;
+        }
+        if(next==nullptr || time<next_time) {
+            next = &t;
+            next_from = w;
+            next_time = time;
+        }
+    }
+    if(next!=nullptr) {
+        window& w = next->current==&next->ring[0]?next->ring[1]:next->ring[0];
+        fill(*next,w,next_from->end);
+    }
+}
+void midi_sampler::heap_swap(size_t lhs,size_t rhs) {
+    size_t l = m_heap[lhs];
+    size_t r = m_heap[rhs];
+    m_heap[lhs] = r;
+    m_heap[rhs] = l;
+    m_tracks[r].heap_index = lhs;
+    m_tracks[l].heap_index = rhs;
+}
+void midi_sampler::heap_up(size_t index) {
+    while(index>0) {
+        size_t parent = (index-1)/2;
+        if(m_tracks[m_heap[parent]].due<=m_tracks[m_heap[index]].due) {
+            break;
+        }
+        heap_swap(parent,index);
+        index = parent;
+    }
+}
+void midi_sampler::heap_down(size_t index) {
+    while(true) {
+        size_t child = index*2+1;
+        if(child>=m_heap_size) {
+            break;
+        }
+        if(child+1<m_heap_size && 
+                m_tracks[m_heap[child+1]].due<m_tracks[m_heap[child]].due) {
+            ++child;
+        }
+        if(m_tracks[m_heap[index]].due<=m_tracks[m_heap[child]].due) {
+            break;
+        }
+        heap_swap(index,child);
+        index = child;
+    }
+}
+void midi_sampler::heap_push(size_t track_index) {
+    size_t index = m_heap_size++;
+    m_heap[index] = track_index;
+    m_tracks[track_index].heap_index = index;
+    m_active[track_index/32]|=(uint32_t(1)<<(track_index%32));
+    heap_up(index);
+}
+void midi_sampler::heap_remove(size_t heap_index) {
+    size_t track_index = m_heap[heap_index];
+    m_tracks[track_index].heap_index = npos;
+    m_active[track_index/32]&=~(uint32_t(1)<<(track_index%32));
+    if(heap_index!=--m_heap_size) {
+        m_heap[heap_index] = m_heap[m_heap_size];
+        m_tracks[m_heap[heap_index]].heap_index = heap_index;
+        heap_up(heap_index);
+        heap_down(heap_index);
     }
 }
 void midi_sampler::deallocate() {
@@ -65,18 +630,69 @@ void midi_sampler::deallocate() {
         // free everything   
         if(m_tracks!=nullptr) {
             for(size_t i = 0;i<m_tracks_size;++i) {
-                track& t = m_tracks[i];
-                if(t.buffer!=nullptr) {
-                    m_deallocator(t.buffer);
-                }
+                free_track(m_tracks[i]);
             }
             m_deallocator(m_tracks);
             m_tracks = nullptr;
             m_tracks_size = 0;
         }
+        if(m_storage!=nullptr) {
+            m_deallocator(m_storage);
+            m_storage = nullptr;
+        }
+        if(m_index!=nullptr) {
+            m_deallocator(m_index);
+            m_index = nullptr;
+        }
+        if(m_tempo_map!=nullptr) {
+            m_deallocator(m_tempo_map);
+            m_tempo_map = nullptr;
+            m_tempo_map_size = 0;
+        }
+        if(m_heap!=nullptr) {
+            m_deallocator(m_heap);
+            m_heap = nullptr;
+            m_heap_size = 0;
+            m_active = nullptr;
+        }
+        if(m_voices!=nullptr) {
+            m_deallocator(m_voices);
+            m_voices = nullptr;
+        }
+        if(m_scratch!=nullptr) {
+            m_deallocator(m_scratch);
+            m_scratch = nullptr;
+        }
+        m_stream = nullptr;
     }
 }
-midi_sampler::midi_sampler() : m_allocator(nullptr),m_deallocator(nullptr),m_tracks_size(0),m_tracks(nullptr){
+midi_sampler::midi_sampler() : m_allocator(nullptr),
+        m_deallocator(nullptr),
+        m_tracks_size(0),
+        m_tracks(nullptr),
+        m_timebase(0),
+        m_storage(nullptr),
+        m_index(nullptr),
+        m_tempo_map(nullptr),
+        m_tempo_map_size(0),
+        m_output(nullptr),
+        m_timed(nullptr),
+        m_lookahead(0),
+        m_horizon(0),
+        m_clock(nullptr),
+        m_now(0),
+        m_clock_last(0),
+        m_clock_fraction(0),
+        m_tempo_multiplier(0x10000),
+        m_heap(nullptr),
+        m_heap_size(0),
+        m_active(nullptr),
+        m_voices(nullptr),
+        m_stream(nullptr),
+        m_scratch(nullptr),
+        m_window_size(0),
+        m_underruns(0),
+        m_all_notes_off(false) {
 
 }
 midi_sampler::midi_sampler(midi_sampler&& rhs) {
@@ -84,6 +700,29 @@ midi_sampler::midi_sampler(midi_sampler&& rhs) {
     m_deallocator = rhs.m_deallocator;
     m_tracks_size = rhs.m_tracks_size;
     m_tracks = rhs.m_tracks;
+    m_timebase = rhs.m_timebase;
+    m_storage = rhs.m_storage;
+    m_index = rhs.m_index;
+    m_tempo_map = rhs.m_tempo_map;
+    m_tempo_map_size = rhs.m_tempo_map_size;
+    m_output = rhs.m_output;
+    m_timed = rhs.m_timed;
+    m_lookahead = rhs.m_lookahead;
+    m_horizon = rhs.m_horizon;
+    m_clock = rhs.m_clock;
+    m_now = rhs.m_now;
+    m_clock_last = rhs.m_clock_last;
+    m_clock_fraction = rhs.m_clock_fraction;
+    m_tempo_multiplier = rhs.m_tempo_multiplier;
+    m_heap = rhs.m_heap;
+    m_heap_size = rhs.m_heap_size;
+    m_active = rhs.m_active;
+    m_voices = rhs.m_voices;
+    m_stream = rhs.m_stream;
+    m_scratch = rhs.m_scratch;
+    m_window_size = rhs.m_window_size;
+    m_underruns = rhs.m_underruns;
+    m_all_notes_off = rhs.m_all_notes_off;
     rhs.m_deallocator = nullptr;
 }
 midi_sampler& midi_sampler::operator=(midi_sampler&& rhs) {
@@ -92,13 +731,36 @@ midi_sampler& midi_sampler::operator=(midi_sampler&& rhs) {
     m_deallocator = rhs.m_deallocator;
     m_tracks_size = rhs.m_tracks_size;
     m_tracks = rhs.m_tracks;
+    m_timebase = rhs.m_timebase;
+    m_storage = rhs.m_storage;
+    m_index = rhs.m_index;
+    m_tempo_map = rhs.m_tempo_map;
+    m_tempo_map_size = rhs.m_tempo_map_size;
+    m_output = rhs.m_output;
+    m_timed = rhs.m_timed;
+    m_lookahead = rhs.m_lookahead;
+    m_horizon = rhs.m_horizon;
+    m_clock = rhs.m_clock;
+    m_now = rhs.m_now;
+    m_clock_last = rhs.m_clock_last;
+    m_clock_fraction = rhs.m_clock_fraction;
+    m_tempo_multiplier = rhs.m_tempo_multiplier;
+    m_heap = rhs.m_heap;
+    m_heap_size = rhs.m_heap_size;
+    m_active = rhs.m_active;
+    m_voices = rhs.m_voices;
+    m_stream = rhs.m_stream;
+    m_scratch = rhs.m_scratch;
+    m_window_size = rhs.m_window_size;
+    m_underruns = rhs.m_underruns;
+    m_all_notes_off = rhs.m_all_notes_off;
     rhs.m_deallocator = nullptr;
     return *this;
 }
 midi_sampler::~midi_sampler() {
     deallocate();
 }
-sfx_result midi_sampler::read(stream& in,midi_sampler* out_sampler,void*(allocator)(size_t),void(deallocator)(void*)) {
+sfx_result midi_sampler::load(stream& in,midi_sampler* out_sampler,size_t window_size,void*(allocator)(size_t),void(deallocator)(void*),void*(image_allocator)(size_t),void(image_deallocator)(void*)) {
     if(out_sampler==nullptr||allocator==nullptr||deallocator==nullptr) {
         return sfx_result::invalid_argument;
     }
@@ -110,166 +772,339 @@ sfx_result midi_sampler::read(stream& in,midi_sampler* out_sampler,void*(allocat
     if(res!=sfx_result::success) {
         return res;
     }
-    track *tracks = (track*)allocator(sizeof(track)*file.tracks_size);
-    if(tracks==nullptr) {
+    if(file.timebase<=0) {
+        // SMPTE timing is not supported
+        return sfx_result::invalid_format;
+    }
+    // build into a temporary so a failure
+    // partway through cleans up after itself
+    midi_sampler result;
+    result.m_allocator = allocator;
+    result.m_deallocator = deallocator;
+    result.m_timebase = file.timebase;
+    result.m_tracks = (track*)allocator(sizeof(track)*file.tracks_size);
+    if(result.m_tracks==nullptr) {
         return sfx_result::out_of_memory;
     }
     for(size_t i = 0;i<file.tracks_size;++i) {
-        track& t = tracks[i];
-        t.buffer = nullptr;
+        init_track(result.m_tracks[i]);
     }
-    for(size_t i = 0;i<file.tracks_size;++i) {
-        track& t = tracks[i];
-        midi_track& mt = file.tracks[i];
-        t.buffer = (uint8_t*)allocator(mt.size);
-        if(t.buffer==nullptr) {
-            res= sfx_result::out_of_memory;
-            goto free_all;
-        }
-        
-        if(mt.offset!=in.seek(mt.offset) || mt.size!=in.read(t.buffer,mt.size)) {
-            res = sfx_result::io_error;
-            goto free_all;
-        }
-        t.tempo_multiplier = 1.0;
-        t.base_microtempo = 500000;
-        t.clock.timebase(file.timebase);
-        t.clock.microtempo(500000);
-        t.clock.tick_callback(callback,&t);
-        t.buffer_size = mt.size;
-        t.buffer_position = 0;
-        t.delay = 0;
-        t.event.message.status = 0;
-        t.event.absolute = 0;
-        t.output = nullptr;
-    }
-    out_sampler->m_allocator = allocator;
-    out_sampler->m_deallocator = deallocator;
-    out_sampler->m_tracks = tracks;
-    out_sampler->m_tracks_size = file.tracks_size;
-    return sfx_result::success;
-free_all:
-    if(tracks!=nullptr) {
-        for(size_t i=0;i<file.tracks_size;++i) {
-            track& t = tracks[i];
-            if(t.buffer!=nullptr)  {
-                deallocator(t.buffer);
+    result.m_tracks_size = file.tracks_size;
+    // the heap and the started bits share a block
+    size_t active_size = (file.tracks_size+31)/32;
+    result.m_heap = (size_t*)allocator(sizeof(size_t)*file.tracks_size+
+        sizeof(uint32_t)*active_size);
+    if(result.m_heap==nullptr) {
+        return sfx_result::out_of_memory;
+    }
+    result.m_active = (uint32_t*)(result.m_heap+file.tracks_size);
+    memset(result.m_active,0,sizeof(uint32_t)*active_size);
+    result.m_voices = (voice_table*)allocator(sizeof(voice_table));
+    if(result.m_voices==nullptr) {
+        return sfx_result::out_of_memory;
+    }
+    new(result.m_voices) voice_table();
+    if(window_size!=0) {
+        result.m_scratch = (uint8_t*)allocator(scratch_size);
+        if(result.m_scratch==nullptr) {
+            return sfx_result::out_of_memory;
+        }
+        result.m_stream = &in;
+        result.m_window_size = window_size;
+    }
+    if(window_size!=0) {
+        // one block holds the head and both ring windows of every track
+        size_t window_bytes = sizeof(sysex_span)*sysex_window_size+
+            sizeof(uint32_t)*window_size*2+
+            sysex_data_window_size;
+        result.m_storage = allocator(window_bytes*3*file.tracks_size);
+        if(result.m_storage==nullptr) {
+            return sfx_result::out_of_memory;
+        }
+        uint8_t* p = (uint8_t*)result.m_storage;
+        for(size_t i = 0;i<file.tracks_size;++i) {
+            track& t = result.m_tracks[i];
+            t.offset = file.tracks[i].offset;
+            t.size = file.tracks[i].size;
+            window* windows[] = {&t.head,&t.ring[0],&t.ring[1]};
+            for(window* w : windows) {
+                w->sysex = (sysex_span*)p;
+                w->ticks = (uint32_t*)(w->sysex+sysex_window_size);
+                w->events = w->ticks+window_size;
+                w->sysex_data = (uint8_t*)(w->events+window_size);
+                p+=window_bytes;
+            }
+            // only the head is read up front
+            cursor cur = {0,0,0};
+            res = result.fill(t,t.head,cur);
+            if(res!=sfx_result::success) {
+                return res;
+            }
+        }
+    } else {
+        // the tracks follow one another, so read them all at once.
+        // the image only lives long enough to be decoded
+        size_t begin = npos;
+        size_t end = 0;
+        for(size_t i = 0;i<file.tracks_size;++i) {
+            midi_track& mt = file.tracks[i];
+            if(mt.offset<begin) {
+                begin = mt.offset;
+            }
+            if(mt.offset+mt.size>end) {
+                end = mt.offset+mt.size;
+            }
+        }
+        if(begin>end) {
+            begin = end;
+        }
+        if(image_allocator==nullptr || image_deallocator==nullptr) {
+            image_allocator = allocator;
+            image_deallocator = deallocator;
+        }
+        uint8_t* image = nullptr;
+        if(end>begin) {
+            image = (uint8_t*)image_allocator(end-begin);
+            if(image==nullptr) {
+                return sfx_result::out_of_memory;
+            }
+            if(begin!=in.seek(begin) || end-begin!=in.read(image,end-begin)) {
+                image_deallocator(image);
+                return sfx_result::io_error;
             }
         }
-        deallocator(tracks);
+        // count every track first so they can share one block
+        size_t storage_size = 0;
+        for(size_t i = 0;i<file.tracks_size;++i) {
+            track& t = result.m_tracks[i];
+            midi_track& mt = file.tracks[i];
+            t.offset = mt.offset;
+            t.size = mt.size;
+            count_track(image+(mt.offset-begin),mt.size,t);
+            if(t.head.size!=0) {
+                storage_size+=sizeof(sysex_span)*t.head.sysex_size+
+                    sizeof(uint32_t)*t.head.size*2+
+                    padded(t.head.sysex_data_size);
+            }
+        }
+        if(storage_size!=0) {
+            result.m_storage = allocator(storage_size);
+            if(result.m_storage==nullptr) {
+                image_deallocator(image);
+                return sfx_result::out_of_memory;
+            }
+        }
+        uint8_t* p = (uint8_t*)result.m_storage;
+        for(size_t i = 0;i<file.tracks_size;++i) {
+            track& t = result.m_tracks[i];
+            p = decode_track(image+(t.offset-begin),t.size,t,p);
+        }
+        if(image!=nullptr) {
+            image_deallocator(image);
+        }
     }
-    return res;
-}
-sfx_result midi_sampler::update() {
-    for(size_t i = 0;i<m_tracks_size;++i) {
-        track& t = m_tracks[i];
-        t.clock.update();
+    // build the seek index for each track, and gather the tempo
+    // changes from all of them into the tempo map. the first pass
+    // counts so one block can hold every track's index, laid out
+    // as all the checkpoints, then the chased sysex, then the chase
+    // lists, then the sysex bytes, which the second pass fills in
+    // track by track. the work buffer is freed after each pass,
+    // while it's still the last thing allocated, so it doesn't
+    // leave a hole in an arena
+    uint32_t* work = (uint32_t*)allocator(sizeof(uint32_t)*chase_work_size);
+    if(work==nullptr) {
+        return sfx_result::out_of_memory;
     }
-    return sfx_result::success;
-}
-void midi_sampler::output(midi_output* value) {
-    for(size_t i = 0;i<m_tracks_size;++i) {
-        m_tracks[i].output = value;
+    size_t checkpoints_total = 0;
+    size_t chase_total = 0;
+    size_t sysex_total = 0;
+    size_t sysex_data_total = 0;
+    size_t tempo_size = 0;
+    for(size_t i = 0;i<file.tracks_size;++i) {
+        size_t checkpoints_size,chase_size,sysex_size,sysex_data_size,tempos_size;
+        res = result.index_track(result.m_tracks[i],work,&checkpoints_size,&chase_size,&sysex_size,&sysex_data_size,&tempos_size);
+        if(res!=sfx_result::success) {
+            break;
+        }
+        checkpoints_total+=checkpoints_size;
+        chase_total+=chase_size;
+        sysex_total+=sysex_size;
+        sysex_data_total+=sysex_data_size;
+        tempo_size+=tempos_size;
     }
-}
-bool midi_sampler::started(size_t index) const {
-    if(0>index || index>=m_tracks_size) {
-        return false;
+    deallocator(work);
+    work = nullptr;
+    if(res!=sfx_result::success) {
+        return res;
     }
-    return m_tracks[index].clock.started();
-}
-sfx_result midi_sampler::start(size_t index, long long advance) {
-    if(0>index || index>=m_tracks_size) {
-        return sfx_result::invalid_argument;
+    // in memory the sysex is chased from the head windows
+    if(window_size==0) {
+        sysex_total = 0;
+        sysex_data_total = 0;
+    }
+    if(checkpoints_total!=0) {
+        result.m_index = allocator(sizeof(checkpoint)*checkpoints_total+
+            sizeof(sysex_span)*sysex_total+
+            sizeof(uint32_t)*chase_total+
+            sysex_data_total);
+        if(result.m_index==nullptr) {
+            return sfx_result::out_of_memory;
+        }
     }
-    track& t = m_tracks[index];
-    if(started(index)) {
-        stop(index);
-    }
-    if(advance>0) {
-        const_buffer_stream cbs(t.buffer,t.buffer_size);
-        t.clock.elapsed(advance);
-        t.event.message.status = 0;
-        t.event.absolute = 0;
-        while(t.event.absolute<(unsigned long long)advance) {
-            if(t.buffer_position>=t.buffer_size) {
-                advance -= t.event.absolute;
-                t.event.absolute = 0;
-                t.event.message.~midi_message();
-                t.event.message.status = 0;
-                t.event.delta = 0;
-                t.delay = 0;
-                t.clock.elapsed(0);
-                t.buffer_position=0;
+    // room for the default tempo, too
+    result.m_tempo_map = (tempo_segment*)allocator(sizeof(tempo_segment)*(tempo_size+1));
+    if(result.m_tempo_map==nullptr) {
+        return sfx_result::out_of_memory;
+    }
+    tempo_segment& seg = result.m_tempo_map[0];
+    seg.tick = 0;
+    seg.microtempo = 500000;
+    seg.time = 0;
+    result.m_tempo_map_size = 1;
+    if(checkpoints_total!=0) {
+        work = (uint32_t*)allocator(sizeof(uint32_t)*chase_work_size);
+        if(work==nullptr) {
+            return sfx_result::out_of_memory;
+        }
+        checkpoint* checkpoints = (checkpoint*)result.m_index;
+        sysex_span* sysex = (sysex_span*)(checkpoints+checkpoints_total);
+        uint32_t* chase = (uint32_t*)(sysex+sysex_total);
+        uint8_t* sysex_data = (uint8_t*)(chase+chase_total);
+        for(size_t i = 0;i<file.tracks_size;++i) {
+            track& t = result.m_tracks[i];
+            t.checkpoints = checkpoints;
+            t.chase = chase;
+            if(window_size!=0) {
+                t.chase_sysex = sysex;
+                t.chase_sysex_data = sysex_data;
             }
-            size_t sz = midi_stream::decode_event(true,cbs,&t.event);
-            if(sz==0) {
+            size_t chase_size,sysex_size,sysex_data_size,tempos_size;
+            res = result.index_track(t,work,&t.checkpoints_size,&chase_size,&sysex_size,&sysex_data_size,&tempos_size);
+            if(res!=sfx_result::success) {
                 break;
             }
-            t.buffer_position+=sz;
-            if(t.event.message.status==0xFF && t.event.message.meta.type==0x51) {
-                int32_t mt = (t.event.message.meta.data[0] << 16) | (t.event.message.meta.data[1] << 8) | t.event.message.meta.data[2];
-                // update the clock microtempo
-                t.base_microtempo = mt;
-                t.clock.microtempo(mt/t.tempo_multiplier);
-            } else if(t.output!=nullptr) {
-                switch(t.event.message.type()) {
-                    case midi_message_type::program_change:
-                    case midi_message_type::control_change:
-                    case midi_message_type::system_exclusive:
-                    case midi_message_type::end_system_exclusive:
-                        t.output->send(t.event.message);
-                    break;
-                default:
-                    break;
-                }
+            if(t.checkpoints_size==0) {
+                // an empty track
+                t.checkpoints = nullptr;
+                t.chase = nullptr;
+                continue;
+            }
+            checkpoints+=t.checkpoints_size;
+            chase+=chase_size;
+            if(window_size!=0) {
+                sysex+=sysex_size;
+                sysex_data+=sysex_data_size;
             }
         }
-    } else if(advance<0) {
-        t.delay = -advance;
+        deallocator(work);
+        if(res!=sfx_result::success) {
+            return res;
+        }
     }
-    t.clock.start();
+    result.build_tempo_map();
+    // keep whatever clock the sampler was already using
+    result.m_clock = out_sampler->m_clock;
+    result.m_clock_last = result.clock_now();
+    *out_sampler = (midi_sampler&&)result;
     return sfx_result::success;
 }
-sfx_result midi_sampler::stop(size_t index) {
-    if(0>index || index>=m_tracks_size) {
+sfx_result midi_sampler::read(stream& in,midi_sampler* out_sampler,void*(allocator)(size_t),void(deallocator)(void*),void*(image_allocator)(size_t),void(image_deallocator)(void*)) {
+    return load(in,out_sampler,0,allocator,deallocator,image_allocator,image_deallocator);
+}
+sfx_result midi_sampler::open(stream& in,midi_sampler* out_sampler,size_t window_size,void*(allocator)(size_t),void(deallocator)(void*)) {
+    if(window_size==0) {
         return sfx_result::invalid_argument;
     }
-    track& t = m_tracks[index];
-    t.clock.stop();
-    t.buffer_position = 0;
-    t.delay = 0;
-    t.event.absolute = 0;
-    t.event.delta = 0;
-    t.event.message.~midi_message();
-    t.event.message.status = 0;
-    t.base_microtempo = 500000;
-    t.clock.microtempo(t.base_microtempo/t.tempo_multiplier);
-    if(t.output!=nullptr) {
-        t.tracker.send_off(*t.output);
+    return load(in,out_sampler,window_size,allocator,deallocator,nullptr,nullptr);
+}
+sfx_result midi_sampler::update() {
+    return update_to(output_sink {this});
+}
+void midi_sampler::output(midi_output* value) {
+    m_output = value;
+    m_timed = nullptr;
+}
+void midi_sampler::output(midi_timed_output* value,unsigned long long lookahead) {
+    m_output = value;
+    m_timed = value;
+    m_lookahead = lookahead;
+}
+void midi_sampler::clock(clock_source* value) {
+    // catch the transport up on the old clock, then carry on from here
+    advance_transport();
+    m_clock = value;
+    m_clock_last = clock_now();
+}
+size_t midi_sampler::next_started(size_t index) const {
+    if(index>=m_tracks_size) {
+        return m_tracks_size;
     }
-    return sfx_result::success;
+    // skip whole words of stopped tracks
+    size_t word = index/32;
+    uint32_t bits = m_active[word]&(~uint32_t(0)<<(index%32));
+    size_t words = (m_tracks_size+31)/32;
+    while(bits==0) {
+        if(++word==words) {
+            return m_tracks_size;
+        }
+        bits = m_active[word];
+    }
+    return word*32+__builtin_ctz(bits);
+}
+bool midi_sampler::started(size_t index) const {
+    if(0>index || index>=m_tracks_size) {
+        return false;
+    }
+    return m_tracks[index].heap_index!=npos;
+}
+sfx_result midi_sampler::start(size_t index, long long advance) {
+    return start_to(output_sink {this},index,advance);
+}
+sfx_result midi_sampler::stop(size_t index) {
+    return stop_to(output_sink {this},index);
 }
 void midi_sampler::tempo_multiplier(float value) {
-    if(value!=value || value==0 || value>5) {
+    if(value!=value || value<=0 || value>5) {
         return;
     }
-    for(size_t i = 0;i<m_tracks_size;++i) {
-        track& t = m_tracks[i];
-        t.tempo_multiplier = value;
-        t.clock.microtempo(t.base_microtempo/value);
-    }
+    // bank the time elapsed at the old rate first
+    advance_transport();
+    m_tempo_multiplier = uint32_t(value*65536.0f+.5f);
 }
 unsigned long long midi_sampler::elapsed(size_t index) const {
     if(0>index || index>=m_tracks_size) {
         return 0 ;
     }
-    return m_tracks[index].clock.elapsed();
+    return elapsed_at(m_tracks[index],m_now);
+}
+unsigned long long midi_sampler::elapsed(size_t index,unsigned long long ago) const {
+    if(0>index || index>=m_tracks_size) {
+        return 0 ;
+    }
+    unsigned long long now = transport_now();
+    unsigned long long scaled = (ago*m_tempo_multiplier)>>16;
+    return elapsed_at(m_tracks[index],scaled<now?now-scaled:0);
+}
+unsigned long long midi_sampler::elapsed_at(const track& t,unsigned long long time) const {
+    if(t.heap_index==npos || time<t.start_time) {
+        return 0;
+    }
+    if(time<t.anchor_time) {
+        if(t.looped) {
+            // before the last loop
+            unsigned long long end = tick_time(t.length);
+            unsigned long long span = t.anchor_time-time;
+            return span<end?time_tick(end-span):0;
+        }
+        // still waiting out a delayed start
+        return time_tick(time-t.start_time);
+    }
+    return time_tick(time-t.anchor_time+t.anchor_offset);
 }
 
 int16_t midi_sampler::timebase(size_t index) const {
     if(0>index || index>=m_tracks_size) {
         return 0 ;
     }
-    return m_tracks[index].clock.timebase();
+    return m_timebase;
 }
@@ -0,0 +1,193 @@
+#include "midi_schedule.hpp"
+#include <string.h>
+using namespace sfx;
+// true if the packed message stops notes. the sender counts those
+// notes as off once it's sent, so these must never be dropped
+static bool is_release(uint32_t message) {
+    switch(uint8_t(message)&0xF0) {
+        case 0x80:
+            return true;
+        case 0x90:
+            return uint8_t(message>>16)==0;
+        case 0xB0:
+            // all sound off, all notes off
+            return uint8_t(message>>8)==120 || uint8_t(message>>8)==123;
+        default:
+            return false;
+    }
+}
+midi_schedule::midi_schedule() : m_size(0),
+        m_sequence(0),
+        m_ready_head(0),
+        m_ready_tail(0),
+        m_released(0),
+        m_total_lateness(0),
+        m_max_lateness(0) {
+    for(size_t i = 0;i<sysex_capacity;++i) {
+        m_sysex_size[i] = 0;
+        m_sysex_state[i] = slot_state::empty;
+    }
+}
+bool midi_schedule::less(size_t lhs,size_t rhs) const {
+    const entry& l = m_heap[lhs];
+    const entry& r = m_heap[rhs];
+    if(l.due!=r.due) {
+        return l.due<r.due;
+    }
+    return int32_t(l.sequence-r.sequence)<0;
+}
+void midi_schedule::heap_down(size_t index) {
+    while(true) {
+        size_t child = index*2+1;
+        if(child>=m_size) {
+            break;
+        }
+        if(child+1<m_size && less(child+1,child)) {
+            ++child;
+        }
+        if(!less(child,index)) {
+            break;
+        }
+        entry tmp = m_heap[index];
+        m_heap[index] = m_heap[child];
+        m_heap[child] = tmp;
+        index = child;
+    }
+}
+void midi_schedule::heap_up(size_t index) {
+    while(index>0) {
+        size_t parent = (index-1)/2;
+        if(!less(index,parent)) {
+            break;
+        }
+        entry tmp = m_heap[index];
+        m_heap[index] = m_heap[parent];
+        m_heap[parent] = tmp;
+        index = parent;
+    }
+}
+midi_schedule::entry midi_schedule::pop() {
+    entry result = m_heap[0];
+    m_heap[0] = m_heap[--m_size];
+    heap_down(0);
+    return result;
+}
+bool midi_schedule::ready_put(uint32_t message) {
+    size_t tail = m_ready_tail;
+    size_t next = (tail+1)&(ready_capacity-1);
+    if(next==m_ready_head) {
+        return false;
+    }
+    m_ready[tail] = message;
+    std::atomic_signal_fence(std::memory_order_release);
+    m_ready_tail = next;
+    return true;
+}
+sfx_result midi_schedule::push(const midi_message& message,unsigned long long due,size_t tag) {
+    if(m_size>=capacity) {
+        uint32_t packed = message.status|(uint32_t(message.msb())<<8)|(uint32_t(message.lsb())<<16);
+        if(message.status>=0xF0 || !is_release(packed)) {
+            return sfx_result::out_of_memory;
+        }
+        // make room by readying the earliest message ahead of
+        // time, which keeps the order, rather than lose a note off.
+        // that can only fail if the output has stopped draining
+        if(!ready_put(m_heap[0].message)) {
+            return sfx_result::out_of_memory;
+        }
+        pop();
+    }
+    entry e;
+    e.due = due;
+    e.tag = tag;
+    if(message.status==0xF0 || message.status==0xF7) {
+        // keep a copy until drain() is done with it
+        if(message.sysex.size>sysex_length) {
+            return sfx_result::out_of_memory;
+        }
+        size_t slot = npos;
+        for(size_t i = 0;i<sysex_capacity;++i) {
+            if(m_sysex_state[i]==slot_state::sent) {
+                m_sysex_state[i] = slot_state::empty;
+            }
+            if(slot==npos && m_sysex_state[i]==slot_state::empty) {
+                slot = i;
+            }
+        }
+        if(slot==npos) {
+            return sfx_result::out_of_memory;
+        }
+        if(message.sysex.size!=0) {
+            memcpy(m_sysex_data[slot],message.sysex.data,message.sysex.size);
+        }
+        m_sysex_size[slot] = message.sysex.size;
+        m_sysex_state[slot] = slot_state::queued;
+        e.message = message.status|(uint32_t(slot)<<8);
+    } else {
+        e.message = message.status|(uint32_t(message.msb())<<8)|(uint32_t(message.lsb())<<16);
+    }
+    e.sequence = m_sequence++;
+    m_heap[m_size] = e;
+    heap_up(m_size++);
+    return sfx_result::success;
+}
+void midi_schedule::cancel(size_t tag) {
+    size_t size = 0;
+    for(size_t i = 0;i<m_size;++i) {
+        entry e = m_heap[i];
+        if(e.tag==tag) {
+            uint8_t status = uint8_t(e.message);
+            if(is_release(e.message)) {
+                // the sender already counts these notes as off,
+                // so release them now rather than leave them hanging
+                e.due = 0;
+                m_heap[size++] = e;
+                continue;
+            }
+            if(status==0xF0 || status==0xF7) {
+                // reclaimed by the next push()
+                m_sysex_state[e.message>>8] = slot_state::sent;
+            }
+            continue;
+        }
+        m_heap[size++] = e;
+    }
+    m_size = size;
+    // put the heap back together
+    for(size_t i = size/2;i-->0;) {
+        heap_down(i);
+    }
+}
+bool midi_schedule::promote(unsigned long long now) {
+    while(m_size>0 && m_heap[0].due<=now) {
+        if(!ready_put(m_heap[0].message)) {
+            // the rest go once drain() catches up
+            break;
+        }
+        entry e = pop();
+        if(e.due!=0) {
+            // immediate messages don't count
+            unsigned long long late = now-e.due;
+            uint32_t l = late>0xFFFFFFFF?0xFFFFFFFF:uint32_t(late);
+            ++m_released;
+            m_total_lateness+=l;
+            if(l>m_max_lateness) {
+                m_max_lateness = l;
+            }
+        }
+    }
+    return ready();
+}
+void midi_schedule::clear() {
+    m_size = 0;
+    m_ready_head = 0;
+    m_ready_tail = 0;
+    for(size_t i = 0;i<sysex_capacity;++i) {
+        m_sysex_state[i] = slot_state::empty;
+    }
+}
+void midi_schedule::reset_lateness() {
+    m_released = 0;
+    m_total_lateness = 0;
+    m_max_lateness = 0;
+}
@@ -0,0 +1,128 @@
+#include <midi_teensy_scheduler.hpp>
+using namespace sfx;
+midi_scheduler_teensy* midi_scheduler_teensy::s_instance = nullptr;
+// keeps the timer interrupt out while the queue is changed.
+// nothing in here touches the USB
+namespace {
+class queue_lock final {
+    uint32_t m_primask;
+public:
+    inline queue_lock() {
+        __asm__ volatile("mrs %0, primask" : "=r"(m_primask));
+        __disable_irq();
+    }
+    inline ~queue_lock() {
+        if(!m_primask) {
+            __enable_irq();
+        }
+    }
+};
+}
+midi_scheduler_teensy::midi_scheduler_teensy() : m_output(nullptr),
+        m_clock(nullptr),
+        m_running(false) {
+}
+midi_scheduler_teensy::~midi_scheduler_teensy() {
+    end();
+}
+sfx_result midi_scheduler_teensy::begin(midi_out_teensy_usb& output,clock_source& clock,uint32_t period) {
+    if(s_instance!=nullptr && s_instance!=this) {
+        return sfx_result::invalid_state;
+    }
+    end();
+    m_output = &output;
+    m_clock = &clock;
+    s_instance = this;
+    m_running = true;
+    // below everything else, so a slow host only holds up loop()
+    attachInterruptVector(IRQ_SOFTWARE,send_s);
+    NVIC_SET_PRIORITY(IRQ_SOFTWARE,255);
+    NVIC_ENABLE_IRQ(IRQ_SOFTWARE);
+    if(!m_timer.begin(release_s,period)) {
+        NVIC_DISABLE_IRQ(IRQ_SOFTWARE);
+        m_running = false;
+        s_instance = nullptr;
+        return sfx_result::io_error;
+    }
+    return sfx_result::success;
+}
+void midi_scheduler_teensy::end() {
+    if(!m_running) {
+        return;
+    }
+    m_timer.end();
+    NVIC_DISABLE_IRQ(IRQ_SOFTWARE);
+    m_running = false;
+    s_instance = nullptr;
+    // nothing is left behind
+    m_schedule.promote((unsigned long long)-1);
+    m_schedule.drain(*m_output);
+    m_output->flush();
+    m_schedule.clear();
+}
+void midi_scheduler_teensy::release_s() {
+    // the timer interrupt only moves what's due
+    midi_scheduler_teensy* This = s_instance;
+    if(This!=nullptr && This->m_schedule.size()!=0 &&
+            This->m_schedule.promote(This->m_clock->now())) {
+        NVIC_SET_PENDING(IRQ_SOFTWARE);
+    }
+}
+void midi_scheduler_teensy::send_s() {
+    // runs at the lowest priority, with interrupts enabled, so
+    // waiting on the USB doesn't hold up the timer or anything else
+    midi_scheduler_teensy* This = s_instance;
+    if(This!=nullptr && This->m_schedule.drain(*This->m_output)) {
+        This->m_output->flush();
+    }
+}
+sfx_result midi_scheduler_teensy::send(const midi_message& message) {
+    return send_at(message,0,(size_t)-1);
+}
+sfx_result midi_scheduler_teensy::send_at(const midi_message& message,unsigned long long due,size_t tag) {
+    if(!m_running) {
+        if(m_output==nullptr) {
+            return sfx_result::invalid_state;
+        }
+        // nothing to wait on
+        return m_output->send(message);
+    }
+    sfx_result result;
+    bool ready;
+    {
+        queue_lock lock;
+        result = m_schedule.push(message,due,tag);
+        ready = m_schedule.ready();
+    }
+    if(ready) {
+        // a full queue readied something early
+        NVIC_SET_PENDING(IRQ_SOFTWARE);
+    }
+    return result;
+}
+void midi_scheduler_teensy::cancel(size_t tag) {
+    queue_lock lock;
+    m_schedule.cancel(tag);
+}
+uint32_t midi_scheduler_teensy::released() const {
+    queue_lock lock;
+    return m_schedule.released();
+}
+uint32_t midi_scheduler_teensy::max_lateness() const {
+    queue_lock lock;
+    return m_schedule.max_lateness();
+}
+uint32_t midi_scheduler_teensy::average_lateness() const {
+    uint32_t released;
+    unsigned long long total;
+    {
+        queue_lock lock;
+        released = m_schedule.released();
+        total = m_schedule.total_lateness();
+    }
+    return released==0?0:uint32_t(total/released);
+}
+void midi_scheduler_teensy::reset_lateness() {
+    queue_lock lock;
+    m_schedule.reset_lateness();
+}
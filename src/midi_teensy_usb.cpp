@@ -1,9 +1,27 @@
 #include <midi_teensy_usb.hpp>
 #include <sfx.hpp>
 using namespace sfx;
+sfx_result midi_usb_packet_decode(uint32_t packet,midi_message* out_message) {
+    // the number of MIDI bytes carried by each code index number,
+    // or zero if the packet isn't a whole message on its own
+    static const uint8_t cin_sizes[] = {
+        0,0,2,3,0,1,0,0,3,3,3,3,2,2,3,1
+    };
+    size_t size = cin_sizes[packet&15];
+    uint8_t status = uint8_t(packet>>8);
+    if(size==0 || status<0x80 || status==0xF0 || status==0xF7) {
+        return sfx_result::invalid_format;
+    }
+    out_message->status = status;
+    out_message->msb(size>1?uint8_t(packet>>16):0);
+    out_message->lsb(size>2?uint8_t(packet>>24):0);
+    return sfx_result::success;
+}
 sfx_result midi_in_teensy_usb_host::initialize() {
     if(!m_initialized) {
         m_usb_host.begin();
+        m_in.setHandlePacket(handle_packet_s,this);
+        // still needed for sysex
         m_in.setHandleMessage(handle_message_s,this);
         m_initialized = true;
     }
@@ -11,7 +29,7 @@ sfx_result midi_in_teensy_usb_host::initialize() {
 }
 void midi_in_teensy_usb_host::update() {
     m_usb_host.Task();
-    m_in.read();
+    m_in.readAll(m_budget);
 }
 void midi_in_teensy_usb_host::handle_message(const uint8_t* data,size_t size) {
     midi_event_ex e;
@@ -23,6 +41,13 @@ void midi_in_teensy_usb_host::handle_message_s(const uint8_t* data,size_t size,v
     midi_in_teensy_usb_host* This = (midi_in_teensy_usb_host*)state;
     This->handle_message(data,size);
 }
+void midi_in_teensy_usb_host::handle_packet_s(uint32_t packet,uint32_t timestamp,void* state) {
+    midi_in_teensy_usb_host* This = (midi_in_teensy_usb_host*)state;
+    midi_event_ex e;
+    if(sfx_result::success==midi_usb_packet_decode(packet,&e.message)) {
+        This->m_buffer.put(e);
+    }
+}
 sfx_result midi_in_teensy_usb_host::receive(midi_message* out_message) {
     if(m_buffer.empty()) {
         return sfx::sfx_result::end_of_stream;
@@ -41,36 +66,31 @@ sfx_result midi_out_teensy_usb::initialize() {
     }
     return sfx_result::success;
 }
-sfx_result midi_out_teensy_usb::send(const midi_message& msg) {
-    switch(msg.type()) {
-        case midi_message_type::note_off:
-        case midi_message_type::note_on:
-        case midi_message_type::polyphonic_pressure:
-        case midi_message_type::control_change:
-        case midi_message_type::pitch_wheel_change:
-            usbMIDI.send((int)msg.type(), msg.msb(),msg.lsb(),msg.channel()+1,0);
-            break;
-        case midi_message_type::song_position:
-        case midi_message_type::program_change:
-        case midi_message_type::channel_pressure:
-        case midi_message_type::song_select:
-            usbMIDI.send((int)msg.type(), msg.msb(),0,msg.channel()+1,0);
-            break;
-        case midi_message_type::system_exclusive:
-            usbMIDI.sendSysEx(msg.sysex.size,msg.sysex.data,false,0);
-            break;
-        case midi_message_type::reset:
-        case midi_message_type::end_system_exclusive:
-        case midi_message_type::active_sensing:
-        case midi_message_type::start_playback:
-        case midi_message_type::stop_playback:
-        case midi_message_type::tune_request:
-        case midi_message_type::timing_clock:
-            usbMIDI.send((int)msg.type(), 0,0,msg.channel()+1,0);
-            break;
-        default:
-            return sfx_result::invalid_format;
-    }
-    usbMIDI.send_now();
+sfx_result midi_out_teensy_usb::send_sysex(const midi_message& msg) {
+    usbMIDI.sendSysEx(msg.sysex.size,msg.sysex.data,false,0);
+    sent();
     return sfx_result::success;
+}
+void midi_out_teensy_usb::sent() {
+    if(!m_batching) {
+        usbMIDI.send_now();
+    } else if(!m_pending) {
+        m_pending = true;
+        m_pending_ts = micros();
+    } else if(micros()-m_pending_ts>=m_max_latency) {
+        flush();
+    }
+}
+void midi_out_teensy_usb::batching(bool value) {
+    if(!value) {
+        // don't strand anything
+        flush();
+    }
+    m_batching = value;
+}
+void midi_out_teensy_usb::flush() {
+    if(m_pending) {
+        usbMIDI.send_now();
+        m_pending = false;
+    }
 }
\ No newline at end of file
@@ -1,40 +1,71 @@
 #include "note_tracker.hpp"
 #include <string.h>
-note_tracker::note_tracker() {
+voice_table::voice_table() {
+    memset(m_counts,0,sizeof(m_counts));
+    memset(m_channels,0,sizeof(m_channels));
+}
+bool voice_table::acquire(uint8_t channel,uint8_t note) {
+    uint16_t& count = m_counts[channel][note];
+    ++m_channels[channel];
+    return 0==count++;
+}
+bool voice_table::release(uint8_t channel,uint8_t note) {
+    uint16_t& count = m_counts[channel][note];
+    if(count==0) {
+        return false;
+    }
+    --m_channels[channel];
+    return 0==--count;
+}
+note_tracker::note_tracker() : m_channels(0) {
     memset(m_notes,0,sizeof(m_notes));
 }
-void note_tracker::process(const sfx::midi_message& message) {
+void note_tracker::hold(uint8_t channel,uint8_t note) {
+    m_notes[channel][note/32]|=uint32_t(1)<<(note%32);
+    m_channels|=(1<<channel);
+}
+void note_tracker::unhold(uint8_t channel,uint8_t note) {
+    uint32_t* notes = m_notes[channel];
+    notes[note/32]&=~(uint32_t(1)<<(note%32));
+    if((notes[0]|notes[1]|notes[2]|notes[3])==0) {
+        m_channels&=~(1<<channel);
+    }
+}
+bool note_tracker::process(const sfx::midi_message& message,voice_table* voices) {
     sfx::midi_message_type t = message.type();
+    if(t!=sfx::midi_message_type::note_off && t!=sfx::midi_message_type::note_on) {
+        return true;
+    }
     uint8_t c = message.channel();
-    uint8_t n = message.msb();
-    size_t b = n /32;
-    size_t bi = n % 32;
-    if(t==sfx::midi_message_type::note_off || 
-            (t==sfx::midi_message_type::note_on &&
-                    message.lsb()==0)) {
-        const uint64_t mask = uint64_t(~(1<<bi));    
-        m_notes[c].bank[b]&=mask;
-        
-    } else if(t==sfx::midi_message_type::note_on) {
-        const uint64_t set = uint64_t(1<<(bi));    
-        m_notes[c].bank[b]|=set;
-        
+    uint8_t n = message.msb()&0x7F;
+    if(t==sfx::midi_message_type::note_off || message.lsb()==0) {
+        if(!holds(c,n)) {
+            // not ours. don't cut a note someone else holds
+            return voices==nullptr || !voices->held(c,n);
+        }
+        unhold(c,n);
+        return voices==nullptr || voices->release(c,n);
     }
+    if(holds(c,n)) {
+        // restruck while we hold it
+        return true;
+    }
+    hold(c,n);
+    return voices==nullptr || voices->acquire(c,n);
 }
-void note_tracker::send_off(sfx::midi_output& output) {
-    for(int i = 0;i<16;++i) {
-        for(int j=0;j<4;++j) {
-            for(int k=0;k<32;++k) {
-                const uint64_t mask = uint64_t(1<<k);
-                if(m_notes[i].bank[j]&mask) {
-                    sfx::midi_message msg;
-                    msg.status = uint8_t(uint8_t(sfx::midi_message_type::note_off)|uint8_t(i));
-                    msg.msb(k+(j*32));
-                    msg.lsb(0);
-                    output.send(msg);
-                }
+void note_tracker::reset(voice_table* voices) {
+    uint32_t channels = m_channels;
+    while(voices!=nullptr && channels!=0) {
+        int c = __builtin_ctz(channels);
+        channels&=channels-1;
+        for(int j = 0;j<4;++j) {
+            uint32_t bits = m_notes[c][j];
+            while(bits!=0) {
+                voices->release(uint8_t(c),uint8_t(j*32+__builtin_ctz(bits)));
+                bits&=bits-1;
             }
         }
     }
     memset(m_notes,0,sizeof(m_notes));
-}
\ No newline at end of file
+    m_channels = 0;
+}
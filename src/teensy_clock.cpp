@@ -0,0 +1,31 @@
+#include <teensy_clock.hpp>
+// kept by the core's SysTick handler
+extern "C" volatile uint32_t systick_millis_count;
+extern "C" volatile uint32_t systick_cycle_count;
+unsigned long long teensy_clock::now() {
+    uint32_t millis,cycles,count,high,primask;
+    // the scheduler's interrupt calls this too, so keep everything out
+    // while the count is read and extended. that also keeps the SysTick
+    // handler from running in the middle of the read
+    __asm__ volatile("mrs %0, primask" : "=r"(primask));
+    __disable_irq();
+    millis = systick_millis_count;
+    cycles = systick_cycle_count;
+    count = ARM_DWT_CYCCNT;
+    if(millis<m_millis_last) {
+        // the millisecond count wrapped, about every 49 days
+        ++m_millis_high;
+    }
+    m_millis_last = millis;
+    high = m_millis_high;
+    if(!primask) {
+        __enable_irq();
+    }
+    uint32_t us = (count-cycles)/(F_CPU_ACTUAL/1000000);
+    if(us>999) {
+        // the tick is late. don't run past it, or we'd go backwards when it lands
+        us = 999;
+    }
+    unsigned long long ms = (((unsigned long long)high)<<32)|millis;
+    return ms*1000+us;
+}
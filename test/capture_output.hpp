@@ -0,0 +1,32 @@
+#pragma once
+#include <vector>
+#include <sfx.hpp>
+#include "clock_source.hpp"
+// a midi_output that records each message along with
+// the clock reading at the time it was sent
+class capture_output final : public sfx::midi_output {
+public:
+    struct event {
+        unsigned long long time;
+        // packed like the sampler's events. sysex is just the status
+        uint32_t message;
+        inline bool operator==(const event& rhs) const { return time==rhs.time && message==rhs.message; }
+    };
+private:
+    clock_source* m_clock;
+    std::vector<event> m_events;
+public:
+    inline capture_output(clock_source& clock) : m_clock(&clock) {}
+    virtual sfx::sfx_result send(const sfx::midi_message& message) {
+        event e;
+        e.time = m_clock->now();
+        e.message = message.status;
+        if(message.status<0xF0) {
+            e.message|=(uint32_t(message.msb())<<8)|(uint32_t(message.lsb())<<16);
+        }
+        m_events.push_back(e);
+        return sfx::sfx_result::success;
+    }
+    inline const std::vector<event>& events() const { return m_events; }
+    inline void clear() { m_events.clear(); }
+};
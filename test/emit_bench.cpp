@@ -0,0 +1,96 @@
+// times the sampler's emit path through the virtual midi_output
+// against the same sink passed at compile time
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include <sfx.hpp>
+#include "midi_sampler.hpp"
+#include "test.hpp"
+using namespace sfx;
+namespace {
+// does just enough with each message that it can't be optimized out
+class counting_sink final : public midi_output {
+    uint32_t m_count;
+    uint32_t m_hash;
+public:
+    inline counting_sink() : m_count(0), m_hash(0) {}
+    inline virtual sfx_result send(const midi_message& message) {
+        ++m_count;
+        m_hash = m_hash*31+message.status+(message.msb()<<8)+(message.lsb()<<16);
+        return sfx_result::success;
+    }
+    inline uint32_t count() const { return m_count; }
+    inline uint32_t hash() const { return m_hash; }
+};
+// plays the whole song passes times as fast as it will go, returning
+// the nanoseconds spent per message
+template<typename Play>
+double run(midi_sampler& sampler,virtual_clock& clock,size_t passes,const counting_sink& sink,Play play) {
+    auto begin = std::chrono::steady_clock::now();
+    for(size_t pass = 0;pass<passes;++pass) {
+        play(true);
+        // 10ms updates over a minute of song
+        for(int i = 0;i<6000;++i) {
+            clock.advance(10000);
+            play(false);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count();
+    return sink.count()?ns/sink.count():0;
+}
+}
+int main(int argc,char** argv) {
+    if(argc<2) {
+        fprintf(stderr,"usage: %s <file.mid> [passes]\n",argv[0]);
+        return 1;
+    }
+    size_t passes = argc>2?(size_t)atoi(argv[2]):20;
+    std::vector<uint8_t> file;
+    if(!test_load(argv[1],&file)) {
+        return 1;
+    }
+    const_buffer_stream stm(file.data(),file.size());
+    midi_sampler sampler;
+    if(sfx_result::success!=midi_sampler::read(stm,&sampler)) {
+        fprintf(stderr,"can't read %s\n",argv[1]);
+        return 1;
+    }
+    virtual_clock clock;
+    sampler.clock(&clock);
+    counting_sink virtual_sink,static_sink;
+    midi_output* output = &virtual_sink;
+    sampler.output(output);
+    double virtual_ns = run(sampler,clock,passes,virtual_sink,[&](bool restart) {
+        if(restart) {
+            for(size_t i = 0;i<sampler.tracks_count();++i) {
+                sampler.start(i);
+            }
+        } else {
+            sampler.update();
+        }
+    });
+    for(size_t i = 0;i<sampler.tracks_count();++i) {
+        sampler.stop(i);
+    }
+    double static_ns = run(sampler,clock,passes,static_sink,[&](bool restart) {
+        if(restart) {
+            for(size_t i = 0;i<sampler.tracks_count();++i) {
+                sampler.start(i,0,static_sink);
+            }
+        } else {
+            sampler.update(static_sink);
+        }
+    });
+    for(size_t i = 0;i<sampler.tracks_count();++i) {
+        sampler.stop(i,static_sink);
+    }
+    printf("%s: %u messages\n",argv[1],(unsigned)virtual_sink.count());
+    printf("virtual midi_output: %.1f ns/message\n",virtual_ns);
+    printf("static sink:         %.1f ns/message\n",static_ns);
+    if(virtual_sink.count()!=static_sink.count() || virtual_sink.hash()!=static_sink.hash()) {
+        printf("the two paths sent different messages\n");
+        return 1;
+    }
+    return 0;
+}
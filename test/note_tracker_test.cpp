@@ -0,0 +1,85 @@
+// checks what the note tracker lets through and what it sends to stop
+#include <vector>
+#include <sfx.hpp>
+#include "note_tracker.hpp"
+#include "capture_output.hpp"
+#include "test.hpp"
+using namespace sfx;
+namespace {
+midi_message make(uint8_t status,uint8_t msb,uint8_t lsb) {
+    midi_message result;
+    result.status = status;
+    result.msb(msb);
+    result.lsb(lsb);
+    return result;
+}
+uint32_t pack(uint8_t status,uint8_t msb,uint8_t lsb) {
+    return status|(uint32_t(msb)<<8)|(uint32_t(lsb)<<16);
+}
+void test_send_off() {
+    virtual_clock clock;
+    capture_output output(clock);
+    note_tracker tracker;
+    CHECK(tracker.process(make(0x90,60,100)));
+    CHECK(tracker.process(make(0x93,127,100)));
+    CHECK(tracker.process(make(0x90,64,100)));
+    CHECK(tracker.process(make(0xB0,7,100)));
+    // released by note on with no velocity
+    CHECK(tracker.process(make(0x90,64,0)));
+    tracker.send_off(output);
+    const std::vector<capture_output::event>& sent = output.events();
+    CHECK(sent.size()==2);
+    CHECK(sent.size()>0 && sent[0].message==pack(0x80,60,0));
+    CHECK(sent.size()>1 && sent[1].message==pack(0x83,127,0));
+    // nothing is held any more
+    output.clear();
+    tracker.send_off(output);
+    CHECK(output.events().empty());
+}
+void test_all_notes_off() {
+    virtual_clock clock;
+    capture_output output(clock);
+    note_tracker tracker;
+    tracker.process(make(0x91,60,100));
+    tracker.process(make(0x91,61,100));
+    tracker.process(make(0x9F,0,100));
+    tracker.send_off(output,true);
+    const std::vector<capture_output::event>& sent = output.events();
+    CHECK(sent.size()==2);
+    CHECK(sent.size()>0 && sent[0].message==pack(0xB1,123,0));
+    CHECK(sent.size()>1 && sent[1].message==pack(0xBF,123,0));
+}
+void test_shared_voices() {
+    virtual_clock clock;
+    capture_output output(clock);
+    voice_table voices;
+    note_tracker a,b;
+    CHECK(a.process(make(0x90,60,100),&voices));
+    // already sounding, so only the first one goes out
+    CHECK(!b.process(make(0x90,60,100),&voices));
+    CHECK(b.process(make(0x90,62,100),&voices));
+    // b still needs 60, so a can't stop it
+    CHECK(!a.process(make(0x80,60,0),&voices));
+    CHECK(voices.held(0,60));
+    a.send_off(output,true,&voices);
+    CHECK(output.events().empty());
+    b.send_off(output,false,&voices);
+    const std::vector<capture_output::event>& sent = output.events();
+    CHECK(sent.size()==2);
+    CHECK(sent.size()>0 && sent[0].message==pack(0x80,60,0));
+    CHECK(sent.size()>1 && sent[1].message==pack(0x80,62,0));
+    CHECK(!voices.channel_held(0));
+    // reset gives the notes back without sending anything
+    output.clear();
+    a.process(make(0x90,60,100),&voices);
+    a.reset(&voices);
+    CHECK(!voices.held(0,60));
+    CHECK(b.process(make(0x90,60,100),&voices));
+}
+}
+int main() {
+    test_send_off();
+    test_all_notes_off();
+    test_shared_voices();
+    return test_result("note_tracker_test");
+}
@@ -0,0 +1,91 @@
+// starts tracks through the quantizer at known times and checks
+// they line up with the track they follow
+#include <vector>
+#include <sfx.hpp>
+#include "midi_quantizer.hpp"
+#include "test.hpp"
+using namespace sfx;
+namespace {
+// the prang files have no tempo changes
+constexpr static const unsigned long long microtempo = 500000;
+// true if the two tracks are on the same beat of the quantize
+// window, allowing a tick either way for rounding
+bool aligned(const midi_sampler& sampler,size_t lhs,size_t rhs,unsigned long long window) {
+    unsigned long long diff = (sampler.elapsed(lhs)+window-sampler.elapsed(rhs))%window;
+    return diff<=1 || diff>=window-1;
+}
+void test_quantize(const std::vector<uint8_t>& data) {
+    const_buffer_stream in(data.data(),data.size());
+    midi_sampler sampler;
+    if(!CHECK(sfx_result::success==midi_sampler::read(in,&sampler)) || !CHECK(sampler.tracks_count()>=3)) {
+        return;
+    }
+    virtual_clock clock(1000000);
+    sampler.clock(&clock);
+    midi_quantizer quantizer;
+    if(!CHECK(sfx_result::success==midi_quantizer::create(sampler,&quantizer))) {
+        return;
+    }
+    const unsigned long long tick = microtempo/sampler.timebase(0);
+    const unsigned long long window = sampler.timebase(0)*quantizer.quantize_beats();
+    // the first key has nothing to follow
+    CHECK(sfx_result::success==quantizer.start(0));
+    CHECK(quantizer.last_timing()==midi_quantizer_timing::exact);
+    CHECK(sampler.elapsed(0)==0);
+    // a little after the next window starts
+    clock.advance((window+10)*tick);
+    sampler.update();
+    CHECK(sfx_result::success==quantizer.start(1));
+    CHECK(quantizer.last_timing()==midi_quantizer_timing::late);
+    CHECK(aligned(sampler,0,1,window));
+    CHECK(sfx_result::success==quantizer.stop(1));
+    CHECK(!sampler.started(1));
+    // a little before the one after, which waits for it
+    clock.advance((window-20)*tick);
+    sampler.update();
+    CHECK(sfx_result::success==quantizer.start(1));
+    CHECK(quantizer.last_timing()==midi_quantizer_timing::early);
+    clock.advance(30*tick);
+    sampler.update();
+    CHECK(aligned(sampler,0,1,window));
+    // judged by when it arrived, not when it was handled
+    clock.advance((window-10+8)*tick);
+    sampler.update();
+    CHECK(sfx_result::success==quantizer.start(2,20*tick));
+    CHECK(quantizer.last_timing()==midi_quantizer_timing::early);
+    clock.advance(30*tick);
+    sampler.update();
+    CHECK(aligned(sampler,0,2,window));
+    // once everything is stopped there's nothing to follow
+    for(size_t i = 0;i<sampler.tracks_count();++i) {
+        CHECK(sfx_result::success==quantizer.stop(i));
+    }
+    clock.advance(50*tick);
+    sampler.update();
+    CHECK(sfx_result::success==quantizer.start(1));
+    CHECK(quantizer.last_timing()==midi_quantizer_timing::exact);
+    CHECK(sampler.elapsed(1)==0);
+    // without quantizing, tracks start where they are
+    quantizer.quantize_beats(0);
+    CHECK(sfx_result::success==quantizer.stop(2));
+    clock.advance(50*tick);
+    sampler.update();
+    CHECK(sfx_result::success==quantizer.start(2));
+    CHECK(quantizer.last_timing()==midi_quantizer_timing::exact);
+    CHECK(sampler.elapsed(2)==0);
+    CHECK(sfx_result::invalid_argument==quantizer.start(sampler.tracks_count()));
+}
+}
+int main(int argc,char** argv) {
+    if(argc<2) {
+        fprintf(stderr,"usage: %s <file.mid>...\n",argv[0]);
+        return 1;
+    }
+    for(int i = 1;i<argc;++i) {
+        std::vector<uint8_t> data;
+        if(CHECK(test_load(argv[i],&data))) {
+            test_quantize(data);
+        }
+    }
+    return test_result("quantizer_test");
+}
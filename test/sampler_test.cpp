@@ -0,0 +1,537 @@
+// plays midi files through the sampler on a virtual clock and checks
+// what comes out against the file as decoded by sfx directly
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <sfx.hpp>
+#include "midi_sampler.hpp"
+#include "capture_output.hpp"
+#include "test.hpp"
+using namespace sfx;
+namespace {
+constexpr static const unsigned long long update_period = 1000;
+struct reference_event {
+    uint32_t tick;
+    uint32_t message;
+};
+struct reference_track {
+    std::vector<reference_event> events;
+    uint32_t length;
+};
+struct reference_tempo {
+    uint32_t tick;
+    int32_t microtempo;
+};
+// the file decoded without the sampler
+struct reference final {
+    int16_t timebase;
+    std::vector<reference_track> tracks;
+    std::vector<reference_tempo> tempos;
+    bool read(const std::vector<uint8_t>& data) {
+        const_buffer_stream in(data.data(),data.size());
+        midi_file file;
+        if(sfx_result::success!=midi_file::read(in,&file)) {
+            return false;
+        }
+        timebase = file.timebase;
+        tracks.clear();
+        tempos.clear();
+        reference_tempo first = {0,500000};
+        tempos.push_back(first);
+        for(size_t i = 0;i<file.tracks_size;++i) {
+            reference_track track;
+            const midi_track& mt = file.tracks[i];
+            in.seek(mt.offset);
+            midi_event_ex e;
+            e.absolute = 0;
+            size_t pos = 0;
+            while(pos<mt.size) {
+                size_t size = midi_stream::decode_event(true,in,&e);
+                if(size==0) {
+                    return false;
+                }
+                pos+=size;
+                uint32_t tick = uint32_t(e.absolute);
+                const midi_message& msg = e.message;
+                if(msg.status==0xFF) {
+                    if(msg.meta.type==0x2F) {
+                        // anything after the end of the track is ignored
+                        break;
+                    }
+                    if(msg.meta.type==0x51 && msg.meta.length==3) {
+                        reference_tempo t = {tick,int32_t((msg.meta.data[0]<<16)|(msg.meta.data[1]<<8)|msg.meta.data[2])};
+                        tempos.push_back(t);
+                    }
+                    continue;
+                }
+                reference_event re;
+                re.tick = tick;
+                re.message = msg.status;
+                if(msg.status<0xF0) {
+                    re.message|=(uint32_t(msg.msb())<<8)|(uint32_t(msg.lsb())<<16);
+                }
+                track.events.push_back(re);
+            }
+            track.length = uint32_t(e.absolute);
+            tracks.push_back(track);
+        }
+        // the same order the sampler keeps, where the last at a tick wins
+        std::stable_sort(tempos.begin(),tempos.end(),[](const reference_tempo& lhs,const reference_tempo& rhs) {
+            return lhs.tick<rhs.tick;
+        });
+        return true;
+    }
+    unsigned long long time(uint32_t tick) const {
+        unsigned long long result = 0;
+        size_t i = 0;
+        while(i+1<tempos.size() && tempos[i+1].tick<=tick) {
+            result+=(unsigned long long)(tempos[i+1].tick-tempos[i].tick)*tempos[i].microtempo/timebase;
+            ++i;
+        }
+        return result+(unsigned long long)(tick-tempos[i].tick)*tempos[i].microtempo/timebase;
+    }
+    // the other way, from microseconds into the song to ticks
+    uint32_t tick(unsigned long long time) const {
+        size_t i = 0;
+        while(i+1<tempos.size() && this->time(tempos[i+1].tick)<=time) {
+            ++i;
+        }
+        return tempos[i].tick+uint32_t((time-this->time(tempos[i].tick))*timebase/tempos[i].microtempo);
+    }
+};
+bool is_note(uint32_t message) {
+    uint8_t type = uint8_t(message)&0xF0;
+    return type==0x80 || type==0x90;
+}
+sfx_result load(const std::vector<uint8_t>& data,const_buffer_stream& in,midi_sampler* out_sampler,bool streaming) {
+    if(streaming) {
+        // small windows, so they get refilled often
+        return midi_sampler::open(in,out_sampler,32);
+    }
+    return midi_sampler::read(in,out_sampler);
+}
+// each track alone should send what's in the file, when it's due,
+// starting with the first events from within start() itself
+void test_plays_on_time(const std::vector<uint8_t>& data,const reference& ref,bool streaming) {
+    const_buffer_stream in(data.data(),data.size());
+    midi_sampler sampler;
+    if(!CHECK(sfx_result::success==load(data,in,&sampler,streaming))) {
+        return;
+    }
+    CHECK(sampler.tracks_count()==ref.tracks.size());
+    virtual_clock clock(1000000);
+    capture_output output(clock);
+    sampler.clock(&clock);
+    sampler.output(&output);
+    for(size_t i = 0;i<sampler.tracks_count();++i) {
+        const reference_track& track = ref.tracks[i];
+        unsigned long long length = ref.time(track.length);
+        output.clear();
+        unsigned long long start = clock.now();
+        CHECK(sfx_result::success==sampler.start(i));
+        size_t first = 0;
+        while(first<track.events.size() && track.events[first].tick==0) {
+            ++first;
+        }
+        CHECK(output.events().size()==first);
+        // twice through, to cover the loop
+        while(clock.now()+update_period<start+length*2) {
+            clock.advance(update_period);
+            sampler.update();
+        }
+        unsigned long long end = clock.now();
+        sampler.stop(i);
+        std::vector<capture_output::event> expected;
+        for(int pass = 0;pass<2;++pass) {
+            for(const reference_event& e : track.events) {
+                unsigned long long time = start+pass*length+ref.time(e.tick);
+                if(time<=end) {
+                    capture_output::event ce = {time,e.message};
+                    expected.push_back(ce);
+                }
+            }
+        }
+        const std::vector<capture_output::event>& actual = output.events();
+        if(!CHECK(actual.size()>=expected.size())) {
+            continue;
+        }
+        for(size_t j = 0;j<expected.size();++j) {
+            const capture_output::event& a = actual[j];
+            const capture_output::event& e = expected[j];
+            if(!CHECK(a.message==e.message && a.time>=e.time && a.time<e.time+update_period)) {
+                fprintf(stderr,"  %s track %d event %d: got %06X at %llu, expected %06X at %llu\n",streaming?"streaming":"memory",(int)i,(int)j,a.message,a.time-start,e.message,e.time-start);
+                break;
+            }
+        }
+        // anything after that is stop() releasing notes
+        for(size_t j = expected.size();j<actual.size();++j) {
+            CHECK(is_note(actual[j].message) && actual[j].time==end);
+        }
+    }
+}
+// starting partway in plays the notes from there on, shifted to now
+void test_advance(const std::vector<uint8_t>& data,const reference& ref,bool streaming) {
+    const_buffer_stream in(data.data(),data.size());
+    midi_sampler sampler;
+    if(!CHECK(sfx_result::success==load(data,in,&sampler,streaming))) {
+        return;
+    }
+    virtual_clock clock(1000000);
+    capture_output output(clock);
+    sampler.clock(&clock);
+    sampler.output(&output);
+    for(size_t i = 0;i<sampler.tracks_count();++i) {
+        const reference_track& track = ref.tracks[i];
+        for(uint32_t advance = 1;advance<track.length;advance+=track.length/7) {
+            output.clear();
+            unsigned long long start = clock.now();
+            unsigned long long offset = ref.time(advance);
+            unsigned long long length = ref.time(track.length);
+            CHECK(sfx_result::success==sampler.start(i,advance));
+            while(clock.now()+update_period<start+length-offset) {
+                clock.advance(update_period);
+                sampler.update();
+            }
+            unsigned long long end = clock.now();
+            std::vector<capture_output::event> actual;
+            for(const capture_output::event& e : output.events()) {
+                if(is_note(e.message)) {
+                    actual.push_back(e);
+                }
+            }
+            size_t j = 0;
+            for(const reference_event& e : track.events) {
+                unsigned long long time = start+ref.time(e.tick)-offset;
+                if(e.tick<advance || !is_note(e.message) || time>end) {
+                    continue;
+                }
+                if(!CHECK(j<actual.size() && actual[j].message==e.message && actual[j].time>=time && actual[j].time<time+update_period)) {
+                    fprintf(stderr,"  %s track %d advance %d event %d\n",streaming?"streaming":"memory",(int)i,(int)advance,(int)j);
+                    break;
+                }
+                ++j;
+            }
+            CHECK(j==actual.size());
+            sampler.stop(i);
+        }
+    }
+}
+// elapsed() follows the file's tempo map through the first loop and into the second
+void test_elapsed(const std::vector<uint8_t>& data,const reference& ref) {
+    const_buffer_stream in(data.data(),data.size());
+    midi_sampler sampler;
+    if(!CHECK(sfx_result::success==midi_sampler::read(in,&sampler))) {
+        return;
+    }
+    virtual_clock clock(1000000);
+    sampler.clock(&clock);
+    for(size_t i = 0;i<sampler.tracks_count();++i) {
+        const reference_track& track = ref.tracks[i];
+        unsigned long long length = ref.time(track.length);
+        unsigned long long start = clock.now();
+        CHECK(sfx_result::success==sampler.start(i));
+        CHECK(sampler.elapsed(i)==0);
+        int step = 0;
+        while(clock.now()+update_period<start+length*2) {
+            clock.advance(update_period);
+            sampler.update();
+            unsigned long long time = (clock.now()-start)%length;
+            // the loop point moves when the track gets there, so skip
+            // the update it happens in
+            if(++step%7!=0 || time<update_period) {
+                continue;
+            }
+            unsigned long long expected = ref.tick(time);
+            unsigned long long actual = sampler.elapsed(i);
+            // allow a tick either way for rounding
+            if(!CHECK(actual+1>=expected && actual<=expected+1)) {
+                fprintf(stderr,"  track %d at %llu: got tick %llu, expected %llu\n",(int)i,time,actual,expected);
+                break;
+            }
+        }
+        sampler.stop(i);
+    }
+}
+// plays everything with tempo changes, restarts and advances
+std::vector<capture_output::event> play_session(const std::vector<uint8_t>& data,bool streaming) {
+    const_buffer_stream in(data.data(),data.size());
+    midi_sampler sampler;
+    virtual_clock clock(1000000);
+    capture_output output(clock);
+    if(!CHECK(sfx_result::success==load(data,in,&sampler,streaming))) {
+        return output.events();
+    }
+    sampler.clock(&clock);
+    sampler.output(&output);
+    for(size_t i = 0;i<sampler.tracks_count();++i) {
+        sampler.start(i);
+    }
+    for(int step = 0;step<3000;++step) {
+        clock.advance(7000);
+        sampler.update();
+        size_t index = step%sampler.tracks_count();
+        if(step%400==399) {
+            sampler.tempo_multiplier(step%800==399?1.5f:.75f);
+        } else if(step%150==149) {
+            sampler.start(index,(step*37)%1500);
+        } else if(step%250==249) {
+            sampler.stop(index);
+        }
+    }
+    for(size_t i = 0;i<sampler.tracks_count();++i) {
+        sampler.stop(i);
+    }
+    return output.events();
+}
+void test_streaming_matches_memory(const std::vector<uint8_t>& data) {
+    std::vector<capture_output::event> memory = play_session(data,false);
+    std::vector<capture_output::event> streaming = play_session(data,true);
+    CHECK(!memory.empty());
+    CHECK(memory==streaming);
+}
+// nothing is left sounding once every track is stopped
+void test_stop_releases_notes(const std::vector<uint8_t>& data,bool all_notes_off) {
+    const_buffer_stream in(data.data(),data.size());
+    midi_sampler sampler;
+    if(!CHECK(sfx_result::success==midi_sampler::read(in,&sampler))) {
+        return;
+    }
+    virtual_clock clock(1000000);
+    capture_output output(clock);
+    sampler.clock(&clock);
+    sampler.output(&output);
+    sampler.all_notes_off(all_notes_off);
+    for(size_t i = 0;i<sampler.tracks_count();++i) {
+        sampler.start(i);
+    }
+    for(int stop_at = 1;stop_at<=3;++stop_at) {
+        // stop at a few odd points, including mid note
+        for(int step = 0;step<1317*stop_at;++step) {
+            clock.advance(update_period);
+            sampler.update();
+        }
+        for(size_t i = 0;i<sampler.tracks_count();++i) {
+            sampler.stop(i);
+            CHECK(!sampler.started(i));
+        }
+        std::set<uint32_t> sounding;
+        for(const capture_output::event& e : output.events()) {
+            uint8_t status = uint8_t(e.message);
+            uint8_t note = uint8_t(e.message>>8);
+            uint8_t velocity = uint8_t(e.message>>16);
+            if((status&0xF0)==0x90 && velocity!=0) {
+                sounding.insert((status&0x0F)<<8|note);
+            } else if(is_note(e.message)) {
+                sounding.erase((status&0x0F)<<8|note);
+            } else if((status&0xF0)==0xB0 && note==123) {
+                for(int n = 0;n<128;++n) {
+                    sounding.erase((status&0x0F)<<8|n);
+                }
+            }
+        }
+        CHECK(sounding.empty());
+        for(size_t i = 0;i<sampler.tracks_count();++i) {
+            sampler.start(i,stop_at*100);
+        }
+    }
+}
+// builds a format 1 file around the given track bodies
+void put_varlen(std::vector<uint8_t>& out,uint32_t value) {
+    uint8_t bytes[4];
+    int count = 0;
+    do {
+        bytes[count++] = uint8_t(value&0x7F);
+        value>>=7;
+    } while(value!=0);
+    while(count-->0) {
+        out.push_back(bytes[count]|(count!=0?0x80:0));
+    }
+}
+void put_be(std::vector<uint8_t>& out,uint32_t value,int bytes) {
+    while(bytes-->0) {
+        out.push_back(uint8_t(value>>(bytes*8)));
+    }
+}
+std::vector<uint8_t> make_file(const std::vector<std::vector<uint8_t>>& tracks) {
+    std::vector<uint8_t> result = {'M','T','h','d',0,0,0,6,0,1};
+    put_be(result,uint32_t(tracks.size()),2);
+    put_be(result,96,2);
+    for(const std::vector<uint8_t>& track : tracks) {
+        const uint8_t mtrk[] = {'M','T','r','k'};
+        result.insert(result.end(),mtrk,mtrk+4);
+        put_be(result,uint32_t(track.size()),4);
+        result.insert(result.end(),track.begin(),track.end());
+    }
+    return result;
+}
+// keeps the bytes of every sysex sent
+class sysex_output final : public sfx::midi_output {
+public:
+    std::vector<std::vector<uint8_t>> messages;
+    virtual sfx_result send(const midi_message& message) {
+        if(message.status==0xF0 || message.status==0xF7) {
+            std::vector<uint8_t> bytes(1,message.status);
+            bytes.insert(bytes.end(),message.sysex.data,message.sysex.data+message.sysex.size);
+            messages.push_back(bytes);
+        }
+        return sfx_result::success;
+    }
+};
+// a track of sysex messages, gap ticks apart, each followed by a short
+// note. they're sized so only a few fit in a streaming window
+std::vector<uint8_t> sysex_file(uint32_t gap,std::vector<std::vector<uint8_t>>* out_messages) {
+    std::vector<uint8_t> track;
+    out_messages->clear();
+    for(uint32_t i = 0;i<12;++i) {
+        std::vector<uint8_t> message(1,(i%3)==2?0xF7:0xF0);
+        uint32_t length = 20+i*37;
+        for(uint32_t j = 0;j+1<length;++j) {
+            message.push_back(uint8_t((i+j)&0x7F));
+        }
+        message.push_back(0xF7);
+        put_varlen(track,i==0?0:gap);
+        track.push_back(message[0]);
+        put_varlen(track,length);
+        track.insert(track.end(),message.begin()+1,message.end());
+        const uint8_t note[] = {0,0x90,uint8_t(60+i),100,12,0x80,uint8_t(60+i),0};
+        track.insert(track.end(),note,note+sizeof(note));
+        out_messages->push_back(message);
+    }
+    const uint8_t end[] = {0,0xFF,0x2F,0};
+    track.insert(track.end(),end,end+sizeof(end));
+    return make_file({track});
+}
+// sysex comes out byte for byte, even when there are more, or more
+// bytes, than one streaming window holds
+void test_sysex(bool streaming) {
+    std::vector<std::vector<uint8_t>> expected;
+    std::vector<uint8_t> data = sysex_file(24,&expected);
+    const_buffer_stream in(data.data(),data.size());
+    midi_sampler sampler;
+    if(!CHECK(sfx_result::success==load(data,in,&sampler,streaming))) {
+        return;
+    }
+    virtual_clock clock(1000000);
+    sysex_output output;
+    sampler.clock(&clock);
+    sampler.output(&output);
+    CHECK(sfx_result::success==sampler.start(0));
+    // 36 ticks each, at 120bpm and 96 ticks a beat is about 5ms a tick
+    for(int step = 0;step<12*36*6;++step) {
+        clock.advance(update_period);
+        sampler.update();
+    }
+    sampler.stop(0);
+    if(CHECK(output.messages.size()>=expected.size())) {
+        for(size_t i = 0;i<expected.size();++i) {
+            CHECK(output.messages[i]==expected[i]);
+        }
+    }
+}
+// starting partway in chases every sysex before that point, both the
+// ones before the checkpoint and the ones after it
+void test_chase_sysex(bool streaming) {
+    std::vector<std::vector<uint8_t>> messages;
+    // 212 ticks apart, so the checkpoint at 16 beats falls after the 8th
+    std::vector<uint8_t> data = sysex_file(200,&messages);
+    const_buffer_stream in(data.data(),data.size());
+    midi_sampler sampler;
+    if(!CHECK(sfx_result::success==load(data,in,&sampler,streaming))) {
+        return;
+    }
+    virtual_clock clock(1000000);
+    sysex_output output;
+    sampler.clock(&clock);
+    sampler.output(&output);
+    CHECK(sfx_result::success==sampler.start(0,2000));
+    // the ones at 0 through 1908
+    if(CHECK(output.messages.size()==10)) {
+        for(size_t i = 0;i<10;++i) {
+            CHECK(output.messages[i]==messages[i]);
+        }
+    }
+}
+// a sysex longer than a window holds can only be played from memory
+void test_long_sysex() {
+    std::vector<uint8_t> track = {0,0xF0};
+    put_varlen(track,600);
+    track.insert(track.end(),599,0x11);
+    track.push_back(0xF7);
+    const uint8_t end[] = {96,0xFF,0x2F,0};
+    track.insert(track.end(),end,end+sizeof(end));
+    std::vector<uint8_t> data = make_file({track});
+    const_buffer_stream in(data.data(),data.size());
+    midi_sampler sampler;
+    CHECK(sfx_result::not_supported==load(data,in,&sampler,true));
+    in.seek(0);
+    if(!CHECK(sfx_result::success==load(data,in,&sampler,false))) {
+        return;
+    }
+    virtual_clock clock(1000000);
+    sysex_output output;
+    sampler.clock(&clock);
+    sampler.output(&output);
+    CHECK(sfx_result::success==sampler.start(0));
+    CHECK(output.messages.size()==1 && output.messages[0].size()==601);
+}
+// a track with everything at tick 0 has nothing to loop, so it
+// finishes on its own, and starting it again plays it again
+void test_restart_tick0(bool streaming) {
+    std::vector<uint8_t> track = {0,0xC0,5,0,0x90,60,100,0,0x80,60,0,0,0xFF,0x2F,0};
+    std::vector<uint8_t> data = make_file({track});
+    const_buffer_stream in(data.data(),data.size());
+    midi_sampler sampler;
+    if(!CHECK(sfx_result::success==load(data,in,&sampler,streaming))) {
+        return;
+    }
+    virtual_clock clock(1000000);
+    capture_output output(clock);
+    sampler.clock(&clock);
+    sampler.output(&output);
+    const uint32_t expected[] = {0x05C0,0x643C90,0x3C80};
+    for(int pass = 0;pass<2;++pass) {
+        output.clear();
+        CHECK(sfx_result::success==sampler.start(0));
+        for(int step = 0;step<10;++step) {
+            clock.advance(update_period);
+            sampler.update();
+        }
+        CHECK(!sampler.started(0));
+        const std::vector<capture_output::event>& sent = output.events();
+        if(CHECK(sent.size()==3)) {
+            for(size_t i = 0;i<3;++i) {
+                CHECK(sent[i].message==expected[i]);
+            }
+        }
+    }
+}
+}
+int main(int argc,char** argv) {
+    if(argc<2) {
+        fprintf(stderr,"usage: %s <file.mid>...\n",argv[0]);
+        return 1;
+    }
+    for(int i = 1;i<argc;++i) {
+        std::vector<uint8_t> data;
+        reference ref;
+        if(!CHECK(test_load(argv[i],&data)) || !CHECK(ref.read(data))) {
+            continue;
+        }
+        test_plays_on_time(data,ref,false);
+        test_plays_on_time(data,ref,true);
+        test_advance(data,ref,false);
+        test_advance(data,ref,true);
+        test_elapsed(data,ref);
+        test_streaming_matches_memory(data);
+        test_stop_releases_notes(data,false);
+        test_stop_releases_notes(data,true);
+    }
+    test_sysex(false);
+    test_sysex(true);
+    test_chase_sysex(false);
+    test_chase_sysex(true);
+    test_long_sysex();
+    test_restart_tick0(false);
+    test_restart_tick0(true);
+    return test_result("sampler_test");
+}
@@ -0,0 +1,169 @@
+// drives the scheduler's queue the way the timer and the sending
+// interrupt would, with a virtual clock standing in for both
+#include <vector>
+#include <sfx.hpp>
+#include "midi_schedule.hpp"
+#include "clock_source.hpp"
+#include "test.hpp"
+using namespace sfx;
+namespace {
+constexpr static const unsigned long long period = 100;
+// records what drain() sends, and when
+class packed_output final {
+public:
+    struct event {
+        unsigned long long time;
+        uint32_t message;
+    };
+private:
+    clock_source* m_clock;
+    std::vector<event> m_events;
+    std::vector<uint8_t> m_sysex;
+public:
+    inline packed_output(clock_source& clock) : m_clock(&clock) {}
+    sfx_result send(const midi_message& message) {
+        event e = {m_clock->now(),message.status};
+        m_events.push_back(e);
+        m_sysex.assign(message.sysex.data,message.sysex.data+message.sysex.size);
+        return sfx_result::success;
+    }
+    sfx_result send_packed(uint32_t message) {
+        event e = {m_clock->now(),message};
+        m_events.push_back(e);
+        return sfx_result::success;
+    }
+    inline const std::vector<event>& events() const { return m_events; }
+    // the bytes of the last sysex sent
+    inline const std::vector<uint8_t>& sysex() const { return m_sysex; }
+    inline void clear() { m_events.clear(); }
+};
+midi_message make(uint8_t status,uint8_t msb,uint8_t lsb) {
+    midi_message result;
+    result.status = status;
+    result.msb(msb);
+    result.lsb(lsb);
+    return result;
+}
+uint32_t pack(uint8_t status,uint8_t msb,uint8_t lsb) {
+    return status|(uint32_t(msb)<<8)|(uint32_t(lsb)<<16);
+}
+// one timer tick followed by the sending interrupt
+void tick(midi_schedule& schedule,virtual_clock& clock,packed_output& output) {
+    clock.advance(period);
+    if(schedule.promote(clock.now())) {
+        schedule.drain(output);
+    }
+}
+void test_release_order() {
+    virtual_clock clock(1000000);
+    packed_output output(clock);
+    midi_schedule schedule;
+    unsigned long long base = clock.now();
+    // queued ahead of time and out of order
+    CHECK(sfx_result::success==schedule.push(make(0x90,62,100),base+3000,0));
+    CHECK(sfx_result::success==schedule.push(make(0x90,60,100),base+1000,1));
+    CHECK(sfx_result::success==schedule.push(make(0x90,61,100),base+2000,0));
+    // the same time goes out in the order it was queued
+    CHECK(sfx_result::success==schedule.push(make(0x80,61,0),base+2000,1));
+    // sysex is copied, so the original can go right away
+    {
+        uint8_t bytes[] = {0x43,0x10,0x4C,0xF7};
+        midi_message sysex;
+        sysex.status = 0xF0;
+        sysex.sysex.data = bytes;
+        sysex.sysex.size = sizeof(bytes);
+        CHECK(sfx_result::success==schedule.push(sysex,base+2500,0));
+        sysex.sysex.data = nullptr;
+    }
+    CHECK(schedule.size()==5);
+    CHECK(!schedule.promote(clock.now()));
+    while(clock.now()<base+4000) {
+        tick(schedule,clock,output);
+    }
+    const std::vector<packed_output::event>& sent = output.events();
+    const uint32_t expected[] = {pack(0x90,60,100),pack(0x90,61,100),pack(0x80,61,0),0xF0,pack(0x90,62,100)};
+    const unsigned long long due[] = {1000,2000,2000,2500,3000};
+    if(!CHECK(sent.size()==5)) {
+        return;
+    }
+    for(size_t i = 0;i<5;++i) {
+        CHECK(sent[i].message==expected[i]);
+        CHECK(sent[i].time>=base+due[i] && sent[i].time<base+due[i]+period);
+    }
+    const uint8_t bytes[] = {0x43,0x10,0x4C,0xF7};
+    CHECK(output.sysex()==std::vector<uint8_t>(bytes,bytes+sizeof(bytes)));
+    CHECK(schedule.size()==0 && !schedule.ready());
+    CHECK(schedule.released()==5);
+    CHECK(schedule.max_lateness()<period);
+}
+void test_cancel_keeps_releases() {
+    virtual_clock clock(1000000);
+    packed_output output(clock);
+    midi_schedule schedule;
+    unsigned long long base = clock.now();
+    schedule.push(make(0x90,60,100),base+5000,1);
+    schedule.push(make(0x80,60,0),base+6000,1);
+    schedule.push(make(0x91,64,0),base+6000,1);
+    schedule.push(make(0xB0,123,0),base+7000,1);
+    schedule.push(make(0xB0,7,100),base+5000,1);
+    schedule.push(make(0x92,40,100),base+5000,2);
+    schedule.cancel(1);
+    // only the other tag's note is left waiting
+    CHECK(schedule.size()==4);
+    tick(schedule,clock,output);
+    const std::vector<packed_output::event>& sent = output.events();
+    if(CHECK(sent.size()==3)) {
+        CHECK(sent[0].message==pack(0x80,60,0));
+        CHECK(sent[1].message==pack(0x91,64,0));
+        CHECK(sent[2].message==pack(0xB0,123,0));
+    }
+    output.clear();
+    while(clock.now()<base+8000) {
+        tick(schedule,clock,output);
+    }
+    CHECK(sent.size()==1 && sent[0].message==pack(0x92,40,100));
+}
+void test_full_queue() {
+    virtual_clock clock(1000000);
+    packed_output output(clock);
+    midi_schedule schedule;
+    unsigned long long base = clock.now();
+    for(size_t i = 0;i<midi_schedule::capacity;++i) {
+        CHECK(sfx_result::success==schedule.push(make(0x90,uint8_t(i&0x7F),100),base+1000+i,0));
+    }
+    CHECK(sfx_result::out_of_memory==schedule.push(make(0x90,1,100),base+500,0));
+    midi_message sysex;
+    sysex.status = 0xF0;
+    CHECK(sfx_result::out_of_memory==schedule.push(sysex,base+500,0));
+    // too long for a slot, even with room in the queue
+    midi_schedule other;
+    std::vector<uint8_t> bytes(midi_schedule::sysex_length+1,0x11);
+    sysex.sysex.data = bytes.data();
+    sysex.sysex.size = bytes.size();
+    CHECK(sfx_result::out_of_memory==other.push(sysex,base+500,0));
+    sysex.sysex.data = nullptr;
+    CHECK(!schedule.ready());
+    // a note off pushes out the earliest rather than be dropped
+    CHECK(sfx_result::success==schedule.push(make(0x80,5,0),base+9000,0));
+    CHECK(schedule.size()==midi_schedule::capacity);
+    CHECK(schedule.ready());
+    schedule.drain(output);
+    const std::vector<packed_output::event>& sent = output.events();
+    CHECK(sent.size()==1 && sent[0].message==pack(0x90,0,100) && sent[0].time==base);
+    // and everything else still goes out in order
+    output.clear();
+    while(clock.now()<base+10000) {
+        tick(schedule,clock,output);
+    }
+    if(CHECK(sent.size()==midi_schedule::capacity)) {
+        CHECK(sent[0].message==pack(0x90,1,100));
+        CHECK(sent.back().message==pack(0x80,5,0));
+    }
+}
+}
+int main() {
+    test_release_order();
+    test_cancel_keeps_releases();
+    test_full_queue();
+    return test_result("schedule_test");
+}
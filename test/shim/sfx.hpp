@@ -0,0 +1,7 @@
+#pragma once
+// just enough of htcw_sfx to build the sampler core on a desktop.
+// the device build uses the real library from platformio.ini
+#include "sfx_core.hpp"
+#include "sfx_midi_core.hpp"
+#include "sfx_midi_stream.hpp"
+#include "sfx_midi_file.hpp"
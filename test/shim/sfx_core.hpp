@@ -0,0 +1,86 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+namespace sfx {
+enum struct sfx_result {
+    success = 0,
+    unknown_error,
+    invalid_argument,
+    out_of_memory,
+    io_error,
+    not_supported,
+    end_of_stream,
+    invalid_format,
+    invalid_state,
+    timeout
+};
+enum struct seek_origin {
+    start = 0,
+    current = 1,
+    end = 2
+};
+struct stream_caps final {
+    uint8_t read : 1;
+    uint8_t write : 1;
+    uint8_t seek : 1;
+};
+class stream {
+public:
+    virtual ~stream() {}
+    virtual size_t read(uint8_t* destination,size_t size)=0;
+    virtual int getch()=0;
+    virtual size_t write(const uint8_t* source,size_t size)=0;
+    virtual int putch(int value)=0;
+    virtual unsigned long long seek(long long position,seek_origin origin = seek_origin::start)=0;
+    virtual stream_caps caps() const=0;
+};
+class const_buffer_stream final : public stream {
+    const uint8_t* m_begin;
+    const uint8_t* m_current;
+    size_t m_size;
+public:
+    inline const_buffer_stream(const uint8_t* buffer,size_t size) : m_begin(buffer), m_current(buffer), m_size(size) {}
+    virtual size_t read(uint8_t* destination,size_t size) {
+        size_t left = m_size-(m_current-m_begin);
+        if(size>left) {
+            size = left;
+        }
+        if(destination!=nullptr) {
+            memcpy(destination,m_current,size);
+        }
+        m_current+=size;
+        return size;
+    }
+    virtual int getch() {
+        if(size_t(m_current-m_begin)>=m_size) {
+            return -1;
+        }
+        return *m_current++;
+    }
+    virtual size_t write(const uint8_t* source,size_t size) { return 0; }
+    virtual int putch(int value) { return -1; }
+    virtual unsigned long long seek(long long position,seek_origin origin = seek_origin::start) {
+        long long pos = position;
+        if(origin==seek_origin::current) {
+            pos+=m_current-m_begin;
+        } else if(origin==seek_origin::end) {
+            pos+=(long long)m_size;
+        }
+        if(pos<0) {
+            pos = 0;
+        } else if(pos>(long long)m_size) {
+            pos = m_size;
+        }
+        m_current = m_begin+pos;
+        return (unsigned long long)pos;
+    }
+    virtual stream_caps caps() const {
+        stream_caps result;
+        result.read = 1;
+        result.write = 0;
+        result.seek = 1;
+        return result;
+    }
+};
+}
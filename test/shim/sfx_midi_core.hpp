@@ -0,0 +1,125 @@
+#pragma once
+#include <stdlib.h>
+#include "sfx_core.hpp"
+namespace sfx {
+enum struct midi_message_type : uint8_t {
+    note_off = 0x80,
+    note_on = 0x90,
+    polyphonic_pressure = 0xA0,
+    control_change = 0xB0,
+    program_change = 0xC0,
+    channel_pressure = 0xD0,
+    pitch_wheel_change = 0xE0,
+    system_exclusive = 0xF0,
+    time_code_quarter_frame = 0xF1,
+    song_position = 0xF2,
+    song_select = 0xF3,
+    tune_request = 0xF6,
+    end_system_exclusive = 0xF7,
+    timing_clock = 0xF8,
+    start_playback = 0xFA,
+    continue_playback = 0xFB,
+    stop_playback = 0xFC,
+    active_sensing = 0xFE,
+    reset = 0xFF,
+    meta_event = 0xFF
+};
+// sysex and meta messages own a copy of their data
+struct midi_message final {
+    uint8_t status;
+    union {
+        uint8_t value8[2];
+        struct {
+            uint8_t type;
+            uint8_t* data;
+            size_t length;
+        } meta;
+        struct {
+            uint8_t* data;
+            size_t size;
+        } sysex;
+    };
+    inline midi_message() : status(0) {
+        meta.type = 0;
+        meta.data = nullptr;
+        meta.length = 0;
+    }
+    inline ~midi_message() { release(); }
+    inline midi_message(const midi_message& rhs) : status(0) { copy(rhs); }
+    inline midi_message& operator=(const midi_message& rhs) {
+        release();
+        copy(rhs);
+        return *this;
+    }
+    inline midi_message(midi_message&& rhs) : status(rhs.status) {
+        meta = rhs.meta;
+        rhs.status = 0;
+        rhs.meta.data = nullptr;
+    }
+    inline midi_message& operator=(midi_message&& rhs) {
+        release();
+        status = rhs.status;
+        meta = rhs.meta;
+        rhs.status = 0;
+        rhs.meta.data = nullptr;
+        return *this;
+    }
+    inline midi_message_type type() const {
+        if(status<0xF0) {
+            return midi_message_type(status&0xF0);
+        }
+        return midi_message_type(status);
+    }
+    inline uint8_t channel() const { return status<0xF0?(status&0x0F):0; }
+    inline uint8_t msb() const { return value8[0]; }
+    inline void msb(uint8_t value) { value8[0] = value; }
+    inline uint8_t lsb() const { return value8[1]; }
+    inline void lsb(uint8_t value) { value8[1] = value; }
+private:
+    inline bool owns() const { return status==0xF0 || status==0xF7 || status==0xFF; }
+    inline void release() {
+        if(owns()) {
+            free(status==0xFF?meta.data:sysex.data);
+        }
+        status = 0;
+        meta.data = nullptr;
+    }
+    inline void copy(const midi_message& rhs) {
+        status = rhs.status;
+        meta = rhs.meta;
+        if(rhs.owns()) {
+            size_t size = status==0xFF?rhs.meta.length:rhs.sysex.size;
+            const uint8_t* data = status==0xFF?rhs.meta.data:rhs.sysex.data;
+            uint8_t* p = nullptr;
+            if(data!=nullptr && size!=0) {
+                p = (uint8_t*)malloc(size);
+                if(p!=nullptr) {
+                    memcpy(p,data,size);
+                }
+            }
+            if(status==0xFF) {
+                meta.data = p;
+            } else {
+                sysex.data = p;
+            }
+        }
+    }
+};
+struct midi_event final {
+    int32_t delta;
+    midi_message message;
+};
+struct midi_event_ex final {
+    unsigned long long absolute;
+    int32_t delta;
+    midi_message message;
+};
+class midi_output {
+public:
+    virtual sfx_result send(const midi_message& message)=0;
+};
+class midi_input {
+public:
+    virtual sfx_result receive(midi_message* out_message)=0;
+};
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include "sfx_midi_core.hpp"
+namespace sfx {
+struct midi_track final {
+    size_t offset;
+    size_t size;
+};
+struct midi_file final {
+    int16_t type;
+    int16_t timebase;
+    size_t tracks_size;
+    midi_track* tracks;
+    inline midi_file() : type(0), timebase(0), tracks_size(0), tracks(nullptr) {}
+    inline ~midi_file() {
+        if(tracks!=nullptr) {
+            free(tracks);
+        }
+    }
+    midi_file(const midi_file& rhs)=delete;
+    midi_file& operator=(const midi_file& rhs)=delete;
+    static sfx_result read(stream& in,midi_file* out_file);
+};
+}
@@ -0,0 +1,2 @@
+#pragma once
+#include "sfx_midi_core.hpp"
@@ -0,0 +1,10 @@
+#pragma once
+#include "sfx_midi_core.hpp"
+namespace sfx {
+struct midi_stream final {
+    // each returns the number of bytes read, or zero on error
+    static size_t decode_message(bool is_file,stream& in,midi_message* in_out_message);
+    static size_t decode_event(bool is_file,stream& in,midi_event_ex* in_out_event);
+    static size_t decode_event(bool is_file,stream& in,midi_event* in_out_event);
+};
+}
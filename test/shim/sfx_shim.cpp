@@ -0,0 +1,179 @@
+#include "sfx_midi_stream.hpp"
+#include "sfx_midi_file.hpp"
+namespace sfx {
+static bool read_varlen(stream& in,int32_t* out_value,size_t* in_out_count) {
+    int32_t value = 0;
+    for(int i = 0;i<4;++i) {
+        int b = in.getch();
+        if(b<0) {
+            return false;
+        }
+        ++*in_out_count;
+        value = (value<<7)|(b&0x7F);
+        if(0==(b&0x80)) {
+            *out_value = value;
+            return true;
+        }
+    }
+    return false;
+}
+static bool read_be(stream& in,int bytes,uint32_t* out_value) {
+    uint32_t value = 0;
+    for(int i = 0;i<bytes;++i) {
+        int b = in.getch();
+        if(b<0) {
+            return false;
+        }
+        value = (value<<8)|uint8_t(b);
+    }
+    *out_value = value;
+    return true;
+}
+static size_t data_bytes(uint8_t status) {
+    switch(status&0xF0) {
+        case 0xC0:
+        case 0xD0:
+            return 1;
+        case 0xF0:
+            if(status==0xF1 || status==0xF3) {
+                return 1;
+            }
+            return status==0xF2?2:0;
+        default:
+            return 2;
+    }
+}
+// reads a length prefixed block into a new allocation
+static bool read_block(stream& in,uint8_t** out_data,size_t* out_size,size_t* in_out_count) {
+    int32_t size;
+    if(!read_varlen(in,&size,in_out_count)) {
+        return false;
+    }
+    *out_size = size;
+    *out_data = nullptr;
+    if(size!=0) {
+        *out_data = (uint8_t*)malloc(size);
+        if(*out_data==nullptr || size_t(size)!=in.read(*out_data,size)) {
+            return false;
+        }
+    }
+    *in_out_count+=size;
+    return true;
+}
+size_t midi_stream::decode_message(bool is_file,stream& in,midi_message* in_out_message) {
+    size_t count = 0;
+    int b = in.getch();
+    if(b<0) {
+        return 0;
+    }
+    ++count;
+    // in_out_message holds the running status
+    bool running = b<0x80;
+    uint8_t status = running?in_out_message->status:uint8_t(b);
+    if(running && (status<0x80 || status>=0xF0)) {
+        return 0;
+    }
+    midi_message msg;
+    msg.status = status;
+    if(status==0xFF && is_file) {
+        int type = in.getch();
+        if(type<0) {
+            return 0;
+        }
+        ++count;
+        msg.meta.type = uint8_t(type);
+        if(!read_block(in,&msg.meta.data,&msg.meta.length,&count)) {
+            return 0;
+        }
+    } else if(status==0xF0 || status==0xF7) {
+        msg.sysex.data = nullptr;
+        msg.sysex.size = 0;
+        if(is_file && !read_block(in,&msg.sysex.data,&msg.sysex.size,&count)) {
+            return 0;
+        }
+    } else {
+        msg.value8[0] = 0;
+        msg.value8[1] = 0;
+        size_t size = data_bytes(status);
+        for(size_t i = 0;i<size;++i) {
+            int d = b;
+            if(i>0 || !running) {
+                d = in.getch();
+                if(d<0) {
+                    return 0;
+                }
+                ++count;
+            }
+            msg.value8[i] = uint8_t(d);
+        }
+    }
+    *in_out_message = (midi_message&&)msg;
+    return count;
+}
+size_t midi_stream::decode_event(bool is_file,stream& in,midi_event_ex* in_out_event) {
+    size_t count = 0;
+    int32_t delta;
+    if(!read_varlen(in,&delta,&count)) {
+        return 0;
+    }
+    size_t size = decode_message(is_file,in,&in_out_event->message);
+    if(size==0) {
+        return 0;
+    }
+    in_out_event->delta = delta;
+    in_out_event->absolute+=delta;
+    return count+size;
+}
+size_t midi_stream::decode_event(bool is_file,stream& in,midi_event* in_out_event) {
+    midi_event_ex e;
+    e.absolute = 0;
+    e.message = in_out_event->message;
+    size_t size = decode_event(is_file,in,&e);
+    if(size!=0) {
+        in_out_event->delta = e.delta;
+        in_out_event->message = (midi_message&&)e.message;
+    }
+    return size;
+}
+sfx_result midi_file::read(stream& in,midi_file* out_file) {
+    if(out_file==nullptr) {
+        return sfx_result::invalid_argument;
+    }
+    uint8_t id[4];
+    uint32_t size,type,count,timebase;
+    if(4!=in.read(id,4) || 0!=memcmp(id,"MThd",4) || !read_be(in,4,&size) || size<6) {
+        return sfx_result::invalid_format;
+    }
+    if(!read_be(in,2,&type) || !read_be(in,2,&count) || !read_be(in,2,&timebase)) {
+        return sfx_result::end_of_stream;
+    }
+    unsigned long long pos = in.seek(size-6,seek_origin::current);
+    midi_track* tracks = (midi_track*)malloc(sizeof(midi_track)*(count?count:1));
+    if(tracks==nullptr) {
+        return sfx_result::out_of_memory;
+    }
+    size_t i = 0;
+    while(i<count) {
+        if(4!=in.read(id,4) || !read_be(in,4,&size)) {
+            free(tracks);
+            return sfx_result::end_of_stream;
+        }
+        pos+=8;
+        // skip chunks that aren't tracks
+        if(0==memcmp(id,"MTrk",4)) {
+            tracks[i].offset = size_t(pos);
+            tracks[i].size = size;
+            ++i;
+        }
+        pos = in.seek(size,seek_origin::current);
+    }
+    if(out_file->tracks!=nullptr) {
+        free(out_file->tracks);
+    }
+    out_file->type = int16_t(type);
+    out_file->timebase = int16_t(timebase);
+    out_file->tracks_size = count;
+    out_file->tracks = tracks;
+    return sfx_result::success;
+}
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+// a failed check is reported and counted, and the test carries on
+#define CHECK(x) test_check((x),#x,__FILE__,__LINE__)
+inline size_t& test_failures() {
+    static size_t failures = 0;
+    return failures;
+}
+inline bool test_check(bool value,const char* text,const char* file,int line) {
+    if(!value) {
+        fprintf(stderr,"%s:%d: failed: %s\n",file,line,text);
+        ++test_failures();
+    }
+    return value;
+}
+// returns 1 if anything failed, for main() to return
+inline int test_result(const char* name) {
+    if(test_failures()!=0) {
+        fprintf(stderr,"%s: %d failed\n",name,(int)test_failures());
+        return 1;
+    }
+    printf("%s: passed\n",name);
+    return 0;
+}
+inline bool test_load(const char* path,std::vector<uint8_t>* out_data) {
+    FILE* f = fopen(path,"rb");
+    if(f==nullptr) {
+        fprintf(stderr,"can't open %s\n",path);
+        return false;
+    }
+    uint8_t buffer[4096];
+    size_t got;
+    out_data->clear();
+    while((got = fread(buffer,1,sizeof(buffer),f))>0) {
+        out_data->insert(out_data->end(),buffer,buffer+got);
+    }
+    fclose(f);
+    return true;
+}